@@ -0,0 +1,94 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "config-watch.h"
+#include "user.h"
+#include "log.h"
+#include "foreach.h"
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sys/inotify.h>
+#endif
+
+using namespace std;
+
+#ifdef __linux__
+
+config_watcher::config_watcher()
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+        log(LOG_WARNING, "inotify_init1() failed, falling back to polling for config changes: %s\n", strerror(errno));
+}
+
+config_watcher::~config_watcher()
+{
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+}
+
+bool config_watcher::watch(class user *user)
+{
+    if (inotify_fd < 0) return false;
+    string path = user->config_path();
+    int wd = inotify_add_watch(inotify_fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB |       // created or modified
+                                                         IN_DELETE | IN_MOVED_FROM |                      // deleted
+                                                         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);     // the whole directory went away
+    if (wd < 0) {
+        log(LOG_INFO, "Not watching %s for %s: %s\n", path.c_str(), user->name.c_str(), strerror(errno));
+        return user->config_watched = false;
+    }
+    vector<class user*> &users = users_by_wd[wd];
+    if (find(users.begin(), users.end(), user) == users.end())
+        users.push_back(user);
+    return user->config_watched = true;
+}
+
+vector<config_watcher::event> config_watcher::read_events()
+{
+    vector<event> events;
+    if (inotify_fd < 0) return events;
+
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t red;
+    while ((red = read(inotify_fd, buf, sizeof(buf))) > 0)
+        for (char *p = buf; p < buf + red; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                log(LOG_WARNING, "inotify queue overflowed, rescanning everything\n");
+                events.push_back((event) { NULL, "", rescan });
+                continue;
+            }
+            if (!users_by_wd.count(ev->wd)) continue;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                // The directory itself is gone. Our watch on it is useless now, so stop thinking we have one.
+                foreach(class user *u, users_by_wd[ev->wd]) {
+                    u->config_watched = false;
+                    events.push_back((event) { u, "", rescan });
+                }
+                if (!(ev->mask & IN_IGNORED))
+                    inotify_rm_watch(inotify_fd, ev->wd);
+                users_by_wd.erase(ev->wd);
+                continue;
+            }
+            if (!ev->len || !is_config_name(ev->name)) continue;
+            change what = ev->mask & (IN_DELETE | IN_MOVED_FROM) ? deleted : created_or_modified;
+            foreach(class user *u, users_by_wd[ev->wd])
+                events.push_back((event) { u, u->config_path() + "/" + ev->name, what });
+        }
+    if (red < 0 && errno != EAGAIN && errno != EINTR)
+        log(LOG_ERR, "read() from inotify failed: %s\n", strerror(errno));
+    return events;
+}
+
+#else /* !__linux__ */
+
+config_watcher::config_watcher() : inotify_fd(-1) {}
+config_watcher::~config_watcher() {}
+bool config_watcher::watch(class user *user) { return user->config_watched = false; }
+vector<config_watcher::event> config_watcher::read_events() { return vector<event>(); }
+
+#endif
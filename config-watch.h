@@ -0,0 +1,33 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __CONFIG_WATCH_H__
+#define __CONFIG_WATCH_H__
+
+#include <string>
+#include <vector>
+#include <map>
+
+// Watches the users' daemon config directories and reports *.conf files that come, go, or change. This is
+// inotify based--on systems without it fd() is -1 and callers have to fall back to stat()ing things.
+class config_watcher {
+  public:
+    enum change { created_or_modified, deleted, rescan };
+    struct event {
+        class user *user;        // NULL (with change == rescan) means "we lost track of everything".
+        std::string config_file;
+        change what;
+    };
+
+    config_watcher();
+    ~config_watcher();
+    int fd() { return inotify_fd; }
+    bool watch(class user *user);
+    std::vector<event> read_events();
+
+  private:
+    int inotify_fd;
+    std::map<int, std::vector<class user*> > users_by_wd;
+};
+
+#endif /* __CONFIG_WATCH_H__ */
+
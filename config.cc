@@ -7,10 +7,14 @@
 #include "stringutil.h"
 #include "log.h"
 #include "foreach.h"
-#include <grp.h>
+#include "passwd.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
 
 using namespace std;
 
@@ -78,28 +82,25 @@ struct master_config parse_master_config(string path)
             split(list, trim(line.substr(sep+1)), string(","));
 
         // Expand @group in list to individual user names.
-        for (auto it = list.begin(); it != list.end(); it++)
-            if ((*it)[0] == '@') {
-                string group = it->substr(1);
-                struct group *g = getgrnam(group.c_str());
-                list.erase(it);
-                if (!g)
-                    log(LOG_ERR, "%s:%d Couldn't find group \"%s\". Ignoring.\n", path.c_str(), n, group.c_str());
-                else
-                    for (int i=0; g->gr_mem[i]; i++)
-                        list.push_back(string(g->gr_mem[i]));
-                it = list.begin(); // start over--our iterator is invalidated by the erase().
+        vector<string> expanded;
+        foreach(string name, list)
+            if (name[0] != '@')
+                expanded.push_back(name);
+            else {
+                vector<string> members;
+                if (!group_members(name.substr(1), &members))
+                    log(LOG_ERR, "%s:%d Couldn't find group \"%s\". Ignoring.\n", path.c_str(), n, name.substr(1).c_str());
+                expanded.insert(expanded.end(), members.begin(), members.end());
             }
+        list = uniq(expanded);
 
         // Expand @group in the key to individual user names by duplicating the list
         if (key[0] == '@') {
-            string group = key.substr(1);
-            struct group *g = getgrnam(group.c_str());
-            if (!g)
-                log(LOG_ERR, "%s:%d Couldn't find group \"%s\". Ignoring line.\n", path.c_str(), n, group.c_str());
-            else
-                for (int i=0; g->gr_mem[i]; i++)
-                    (*section)[g->gr_mem[i]] = uniq(concat((*section)[g->gr_mem[i]], list));
+            vector<string> members;
+            if (!group_members(key.substr(1), &members))
+                log(LOG_ERR, "%s:%d Couldn't find group \"%s\". Ignoring line.\n", path.c_str(), n, key.substr(1).c_str());
+            foreach(string member, members)
+                (*section)[member] = uniq(concat((*section)[member], list));
         } else
             (*section)[key] = uniq(concat((*section)[key], list));
     }
@@ -107,9 +108,16 @@ struct master_config parse_master_config(string path)
     return config;
 }
 
-struct daemon_config parse_daemon_config(string path)
+struct daemon_config parse_daemon_config(int fd, string path)
 {
-    ifstream in(path.c_str(), ifstream::in);
+    string contents;
+    char buf[4096];
+    ssize_t red;
+    while ((red = read(fd, buf, sizeof(buf))) > 0 || (red < 0 && errno == EINTR))
+        if (red > 0) contents.append(buf, red);
+    if (red < 0) throw_strerr("Couldn't read %s", path.c_str());
+
+    istringstream in(contents);
     struct daemon_config config;
 
     int n=0;
@@ -162,3 +170,64 @@ list<string> validate_keys(map<string,string> cfg, const string &file, const vec
 {
     return validate_keys_inner(cfg, file, valid_keys, false);
 }
+
+long long_setting(map<string,string> settings, const string &key, long default_value)
+{
+    if (!settings.count(key)) return default_value;
+    const char *value = settings[key].c_str();
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (!*value || *end) throw_str("%s must be a number, not \"%s\"", key.c_str(), value);
+    return n;
+}
+
+static long long scaled_setting(map<string,string> settings, const string &key, long long default_value,
+                                 const char *what, const map<char,long long> &units)
+{
+    if (!settings.count(key)) return default_value;
+    const char *value = settings[key].c_str();
+    char *end;
+    long long n = strtoll(value, &end, 10);
+    if (*end && units.count(*end) && !end[1])
+        n *= units.at(*end++);
+    if (!*value || *end || n < 0) throw_str("%s must be %s, not \"%s\"", key.c_str(), what, value);
+    return n;
+}
+
+long long size_setting(map<string,string> settings, const string &key, long long default_value)
+{
+    return scaled_setting(settings, key, default_value, "a size (like 100K, 10M or 1G)",
+                          { {'K', 1024LL}, {'M', 1024LL*1024}, {'G', 1024LL*1024*1024} });
+}
+
+long long duration_setting(map<string,string> settings, const string &key, long long default_value)
+{
+    return scaled_setting(settings, key, default_value, "a time (like 30s, 10m, 12h or 7d)",
+                          { {'s', 1LL}, {'m', 60LL}, {'h', 60LL*60}, {'d', 24LL*60*60} });
+}
+
+long long percent_setting(map<string,string> settings, const string &key, long long default_value)
+{
+    return scaled_setting(settings, key, default_value, "a percentage (like 10%)", { {'%', 1LL} });
+}
+
+double number_setting(map<string,string> settings, const string &key, double default_value)
+{
+    if (!settings.count(key)) return default_value;
+    const char *value = settings[key].c_str();
+    char *end;
+    double n = strtod(value, &end);
+    if (!*value || *end || !isfinite(n) || n < 0) // strtod() takes "nan", "inf" and "1e999" too.
+        throw_str("%s must be a number (like 2 or 1.5), not \"%s\"", key.c_str(), value);
+    return n;
+}
+
+bool bool_setting(map<string,string> settings, const string &key, bool default_value)
+{
+    if (!settings.count(key)) return default_value;
+    const string &value = settings[key];
+    if (value == "yes" || value == "true"  || value == "on"  || value == "1") return true;
+    if (value == "no"  || value == "false" || value == "off" || value == "0") return false;
+    throw_str("%s must be \"yes\" or \"no\", not \"%s\"", key.c_str(), value.c_str());
+    return default_value; // Can't happen--just here to shut gcc up.
+}
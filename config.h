@@ -25,9 +25,15 @@ typedef map<string, vector<string> >::iterator config_it;
 typedef vector<string>::iterator config_list_it;
 
 struct master_config parse_master_config(string path);
-struct daemon_config parse_daemon_config(string path);
+struct daemon_config parse_daemon_config(int fd, string path);
 list<string> validate_keys(map<string,string> cfg, const string &file, const vector<string> &valid_keys);
 void validate_keys_pedantically(map<string,string> cfg, const string &file, const vector<string> &valid_keys);
+long long_setting(map<string,string> settings, const string &key, long default_value);
+long long size_setting(map<string,string> settings, const string &key, long long default_value);     // 10K, 5M, 1G
+long long duration_setting(map<string,string> settings, const string &key, long long default_value); // seconds, or 30s, 10m, 12h, 7d
+bool bool_setting(map<string,string> settings, const string &key, bool default_value);
+double number_setting(map<string,string> settings, const string &key, double default_value); // 1.5
+long long percent_setting(map<string,string> settings, const string &key, long long default_value); // 10%
 
 #endif /* __MASTER_CONFIG_H__ */
 
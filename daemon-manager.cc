@@ -5,8 +5,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <string>
 #include <list>
+#include <set>
+#include <deque>
+#include <memory>
+#include <unordered_map>
 #include <algorithm>
 #include <err.h>
 #include <errno.h>
@@ -15,9 +20,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
-#include <poll.h>
+#include <sys/stat.h>
 #include <signal.h>
+#include <poll.h>
 #include <pwd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 #include "config.h"
 #include "user.h"
 #include "daemon.h"
@@ -33,6 +42,14 @@
 #include "stringutil.h"
 #include "json-escape.h"
 #include "peercred.h"
+#include "config-watch.h"
+#include "event-loop.h"
+#include "timers.h"
+#include "posix-util.h"
+#include "spawn.h"
+#include "snapshot.h"
+#include "state-journal.h"
+#include "proc-stats.h"
 
 using namespace std;
 
@@ -45,19 +62,35 @@ static void usage(char *me, int exit_code)
 static void daemonize();
 static void create_pidfile(string pidfile);
 static vector<user*> user_list_from_config(struct master_config config);
-static vector<class daemon*>empty_daemon_list(0);
-static vector<class daemon*> load_daemons(vector<user*> user_list, vector<class daemon*>existing = empty_daemon_list);
-static void import_daemons(vector<class daemon*> daemons, FILE *f);
-static void export_daemons(vector<class daemon*> daemons, FILE *f);
+struct scan_stats {
+    size_t files;      // Config files we found.
+    size_t changed;    // Known ones whose file changed since it was loaded.
+    size_t new_files;
+    int64_t ms;
+};
+static vector<class daemon*> load_daemons(vector<user*> user_list, scan_stats *stats = NULL);
+static void add_daemons(vector<class daemon*> *daemons, vector<class daemon*> new_daemons);
+static void handle_config_changes(vector<user*> users, vector<class daemon*> *daemons);
+static void cull_daemons(vector<user*> users, vector<class daemon*> *daemons);
+static void import_daemons(vector<class daemon*> daemons, int fd);
+static void adopt_orphans();
+static void open_journal(vector<class daemon*> daemons);
 static void autostart(vector<class daemon*> daemons);
-static int open_server_socket();
+static int open_server_socket(int backlog);
+static int inherit_server_socket(int backlog);
 static void select_loop(vector<user*> users, vector<class daemon*> daemons, int command_socket_fd);
-static vector<class daemon*> manageable_by_user(user *user, vector<class daemon*> daemons);
-static string do_command(string command_line, user *user, vector<class daemon*> *daemons);
+static vector<class daemon*> manageable_by_user(user *user);
+typedef function<bool(string &out)> response_stream; // Appends the next piece of a long response to out. false means it's done.
+                                                     // Appending nothing (and returning true) means "nothing yet, ask later".
+static string do_command(string command_line, user *user, vector<class daemon*> *daemons, response_stream *more);
 static void dump_config(struct master_config config);
+static void log_nss_cache_stats();
 
 static char *daemon_manager_exe_path;
 static char **daemon_manager_argv;
+static config_watcher *watcher;
+static size_t max_clients;
+static state_journal *journal;
 int main(int argc, char **argv)
 {
     daemon_manager_exe_path = argv[0];
@@ -84,11 +117,33 @@ int main(int argc, char **argv)
     init_log(!debug, min(LOG_DEBUG, LOG_NOTICE + verbose));
 
     struct master_config config;
+    int command_socket_backlog;
+    bool use_spawner;
+    long long stats_interval;
     try {
         permissions::check(config_path, 0113, 0, 0);
         config = parse_master_config(config_path);
         validate_keys_pedantically(config.settings, config_path,
-                                   { "daemon-path-daemon", "daemon-path-log", "daemon-path-daemon-root", "daemon-path-log-root" });
+                                   { "daemon-path-daemon", "daemon-path-log", "daemon-path-daemon-root", "daemon-path-log-root",
+                                     "command-socket-backlog", "max-clients", "nss-cache-ttl", "max-concurrent-spawns", "spawner", "lastlog-size", "state-journal", "stats-interval",
+                                     "cooldown", "cooldown-factor", "cooldown-max", "cooldown-jitter", "cooldown-reset" });
+        long backlog           = long_setting(config.settings, "command-socket-backlog", SOMAXCONN);
+        long clients_limit     = long_setting(config.settings, "max-clients", 256);
+        if (backlog < 1 || backlog > INT_MAX) throw_str("command-socket-backlog must be between 1 and %d", INT_MAX);
+        if (clients_limit < 1)                throw_str("max-clients can't be less than 1");
+        command_socket_backlog = backlog;
+        max_clients            = clients_limit;
+        nss_cache_set_ttl(long_setting(config.settings, "nss-cache-ttl", 60));
+        long spawns_limit      = long_setting(config.settings, "max-concurrent-spawns", 32);
+        if (spawns_limit < 0) throw_str("max-concurrent-spawns can't be negative (0 means no limit)");
+        set_max_concurrent_spawns(spawns_limit);
+        use_spawner            = bool_setting(config.settings, "spawner", false);
+        set_default_lastlog_size(size_setting(config.settings, "lastlog-size", 0));
+        set_default_backoff(backoff_settings(config.settings));
+        stats_interval         = duration_setting(config.settings, "stats-interval", 10);
+        string journal_path = config.settings.count("state-journal") ? config.settings["state-journal"] : "/var/run/daemon-manager.journal";
+        if (!journal_path.empty())
+            journal = new state_journal(journal_path);
     } catch(std::exception &e) {
         log(LOG_ERR, "Couldn't load config file: %s\n", e.what());
         exit(EXIT_FAILURE);
@@ -102,33 +157,60 @@ int main(int argc, char **argv)
     if (pidfile != "")
         create_pidfile(pidfile);
 
-    int command_socket_fd;
-    try { command_socket_fd = open_server_socket(); }
+#ifdef __linux__
+    // Whatever a daemon leaves behind when it exits (the real daemon after a double fork, say) gets handed
+    // to us instead of init, so it gets reaped (and isn't lost track of) like everything else.
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+        log(LOG_WARNING, "Couldn't become a subreaper: %s\n", strerror(errno));
+#endif
+
+    // Before we've loaded anything, so it's as small as it's ever going to be.
+    if (use_spawner)
+        start_spawner();
+
+    int command_socket_fd = -1;
+    if (getenv("dm_command_socket_fd"))
+        try { command_socket_fd = inherit_server_socket(command_socket_backlog); }
+        catch(std::exception &e) { log(LOG_WARNING, "Couldn't keep the command socket across the re-exec (making a new one): %s\n", e.what()); }
+    if (command_socket_fd < 0)
+        try { command_socket_fd = open_server_socket(command_socket_backlog); }
+        catch(std::exception &e) {
+            log(LOG_ERR, "Couldn't open command socket: %s\n", e.what());
+            exit(EXIT_FAILURE);
+        }
+
+    vector<user*> users = user_list_from_config(config);
+
+    // Daemons hang things on this (log collectors, for instance) as soon as they're loaded.
+    try { main_loop = new event_loop(); }
     catch(std::exception &e) {
-        log(LOG_ERR, "Couldn't open command socket: %s\n", e.what());
+        log(LOG_ERR, "Couldn't set up event loop: %s\n", e.what());
         exit(EXIT_FAILURE);
     }
 
-    vector<user*> users = user_list_from_config(config);
+    // Start watching before we load so that we can't miss anything that shows up while we're loading.
+    watcher = new config_watcher();
+    foreach(user *u, users)
+        watcher->watch(u);
 
-    vector<class daemon*> daemons = load_daemons(users);
+    vector<class daemon*> daemons;
+    add_daemons(&daemons, load_daemons(users));
 
     if (reincarnating) {
-        FILE *import = fdopen(atoi(getenv("dm_running_daemons_fd")), "r+");
-        try {
-            if (!import) throw_strerr("fdopen() failed");
-            unsetenv("dm_running_daemons_fd");
-            import_daemons(daemons, import);
-        } catch(std::exception &e) {
-            log(LOG_ERR, "Couldn't import old state: %s\n", e.what());
-            log(LOG_ERR, "Daemons have all been forgotten--kill the pids manually. Sorry.");
-        }
-        if (import)
-            fclose(import);
+        int import = atoi(getenv("dm_running_daemons_fd"));
+        unsetenv("dm_running_daemons_fd");
+        import_daemons(daemons, import);
+        close(import);
+    } else if (journal)
+        adopt_orphans(); // In case the last one of us crashed.
+    if (journal)
+        open_journal(daemons);
+    start_proc_sampling(stats_interval * 1000);
+    if (getenv("dm_reexec_start_ms")) {
+        log(LOG_NOTICE, "Re-exec took %lldms\n", (long long)(monotonic_ms() - atoll(getenv("dm_reexec_start_ms"))));
+        unsetenv("dm_reexec_start_ms");
     }
 
-    autostart(daemons);
-
     select_loop(users, daemons, command_socket_fd);
 
     return 0;
@@ -238,44 +320,220 @@ static vector<user*> user_list_from_config(struct master_config config)
         }
         if (!contains(u->manages, u)) // We can always manage ourselves.
             u->manages.push_back(u);
+        foreach(user *m, u->manages)
+            u->can_manage[m] = true;
     }
     return user_list;
 }
 
-static vector<class daemon*> load_daemons(vector<user*> user_list, vector<class daemon*>existing)
+static map<string, class daemon*> daemon_by_config;
+static unordered_map<string, class daemon*> daemon_by_id;
+static set<class daemon*> deleted_configs; // The watcher saw these go away--they get culled once they stop.
+
+// Only config files we haven't seen before get parsed. Ones we already have just get a stat() to see if they need
+// reloading the next time they start.
+static vector<class daemon*> load_daemons(vector<user*> user_list, scan_stats *stats)
 {
-    sort(existing.begin(), existing.end(), daemon_compare);
+    scan_stats scan = { 0, 0, 0, monotonic_ms() };
     vector<class daemon*> daemons;
     foreach(class user *u, user_list) {
+        int dir_fd = -1;
         try {
-            foreach(string conf, u->config_files()) {
-                try {
-                    class daemon *d = new class daemon(conf, u);
-                    if (!binary_search(existing.begin(), existing.end(), d, daemon_compare)) {
-                        daemons.push_back(d);
-                        log(LOG_INFO, "Loaded daemon %s for %s\n", conf.c_str(), u->name.c_str());
-                    } else {
-                        log(LOG_DEBUG, "Skipping daemon %s we've already seen\n", d->id.c_str());
-                        delete d;
+            foreach(string name, u->config_files(&dir_fd)) {
+                string conf = u->config_path() + "/" + name;
+                scan.files++;
+                auto known = daemon_by_config.find(conf);
+                if (known != daemon_by_config.end()) {
+                    struct stat st;
+                    if (fstatat(dir_fd, name.c_str(), &st, 0) == 0 && st.st_mtime != known->second->config_file_stamp && !known->second->config_stale) {
+                        log(LOG_DEBUG, "%s has changed, will reload it on next start\n", known->second->id.c_str());
+                        known->second->config_stale = true;
+                        scan.changed++;
                     }
+                    continue;
+                }
+                int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_CLOEXEC);
+                try {
+                    if (fd < 0) throw_strerr("Couldn't open %s", conf.c_str());
+                    class daemon *d = new class daemon(conf, u, fd);
+                    close(fd);
+                    fd = -1;
+                    daemons.push_back(d);
+                    scan.new_files++;
+                    log(LOG_INFO, "Loaded daemon %s for %s\n", conf.c_str(), u->name.c_str());
                 } catch(std::exception &e) {
+                    if (fd >= 0) close(fd);
                     log(LOG_ERR, "Skipping %s's config file %s: %s\n", u->name.c_str(), conf.c_str(), e.what());
                 }
             }
         } catch (std::exception &e) {
             log(LOG_ERR, "Skipping %s's config files: %s\n", u->name.c_str(), e.what());
         }
+        if (dir_fd >= 0) close(dir_fd);
     }
+    scan.ms = monotonic_ms() - scan.ms;
+    log(LOG_DEBUG, "Scanned %zd config files in %lldms: %zd new, %zd changed\n", scan.files, (long long)scan.ms, scan.new_files, scan.changed);
+    if (stats) *stats = scan;
     return daemons;
 }
 
+static void broadcast_event(class daemon *d, const char *event, int value);
+
+static void add_daemons(vector<class daemon*> *daemons, vector<class daemon*> new_daemons)
+{
+    daemons->insert(daemons->end(), new_daemons.begin(), new_daemons.end());
+    foreach(class daemon *d, new_daemons) {
+        daemon_by_config[d->config_file] = d;
+        daemon_by_id[d->id] = d;
+        d->user->daemons.push_back(d);
+        broadcast_event(d, "new", 0);
+    }
+}
+
+static void cull_daemon(vector<class daemon*> *daemons, class daemon *d)
+{
+    log(LOG_INFO, "Culling %s because %s has disappeared.\n", d->id.c_str(), d->config_file.c_str());
+    daemons->erase(find(daemons->begin(), daemons->end(), d));
+    daemon_by_config.erase(d->config_file);
+    daemon_by_id.erase(d->id);
+    d->user->daemons.erase(find(d->user->daemons.begin(), d->user->daemons.end(), d));
+    deleted_configs.erase(d);
+    broadcast_event(d, "cull", 0);
+    delete d;
+}
+
+// Cull daemons whose config files have been deleted. We only have to stat() the ones the watcher told us about,
+// except for users whose config directories aren't being watched--those have to be checked every time.
+static void cull_daemons(vector<user*> users, vector<class daemon*> *daemons)
+{
+    set<class daemon*> suspects = deleted_configs;
+    bool polling = false;
+    foreach(user *u, users)
+        polling = polling || !u->config_watched;
+    if (polling)
+        foreach(class daemon *d, *daemons)
+            if (!d->user->config_watched)
+                suspects.insert(d);
+
+    foreach(class daemon *d, suspects)
+        if (d->current.state == stopped || d->current.state == coolingdown) {
+            if (d->exists())
+                deleted_configs.erase(d);
+            else
+                cull_daemon(daemons, d);
+        }
+}
+
+static void handle_config_changes(vector<user*> users, vector<class daemon*> *daemons)
+{
+    vector<user*> lost;
+    vector<class daemon*> new_daemons;
+    foreach(config_watcher::event e, watcher->read_events()) {
+        if (e.what == config_watcher::rescan) {
+            if (e.user) lost.push_back(e.user);
+            else        lost = users;
+            continue;
+        }
+
+        class daemon *d = daemon_by_config.count(e.config_file) ? daemon_by_config[e.config_file] : NULL;
+        if (e.what == config_watcher::deleted) {
+            if (d) deleted_configs.insert(d);
+        } else if (d) {
+            deleted_configs.erase(d); // Editors like to delete and recreate files when saving.
+            d->config_stale = true;
+        } else {
+            try {
+                d = new class daemon(e.config_file, e.user);
+                log(LOG_INFO, "Loaded new daemon %s for %s\n", e.config_file.c_str(), e.user->name.c_str());
+                add_daemons(daemons, vector<class daemon*>(1, d));
+                new_daemons.push_back(d);
+            } catch(std::exception &ex) {
+                log(LOG_ERR, "Skipping %s's config file %s: %s\n", e.user->name.c_str(), e.config_file.c_str(), ex.what());
+            }
+        }
+    }
+
+    // We don't know what happened to these users' directories, so check everything the slow way.
+    if (lost.size()) {
+        lost = uniq(lost);
+        foreach(user *u, lost)
+            watcher->watch(u);
+        foreach(class daemon *d, *daemons)
+            if (contains(lost, d->user))
+                deleted_configs.insert(d);
+        vector<class daemon*> found = load_daemons(lost);
+        add_daemons(daemons, found);
+        new_daemons.insert(new_daemons.end(), found.begin(), found.end());
+    }
+
+    autostart(new_daemons);
+}
+
 static void autostart(vector<class daemon*> daemons)
 {
     // Now start all the daemons marked "autostart"
     foreach(class daemon *d, daemons)
         if (d->config.autostart && d->current.state == stopped)
-            try { d->start(); }
-            catch(std::exception &e) { log(LOG_ERR, "Couldn't start %s: %s\n", d->id.c_str(), e.what()); }
+            d->queue_start();
+}
+
+// Anything the journal says is running gets adopted as long as its pid still belongs to the same process.
+// Otherwise autostart() would start a second copy of it.
+static void adopt_orphans()
+{
+    int64_t start = monotonic_ms();
+    map<string,state_journal::entry> orphans;
+    try { orphans = journal->recover(); }
+    catch(std::exception &e) { log(LOG_WARNING, "Couldn't read the state journal: %s\n", e.what()); }
+    if (orphans.empty()) return;
+
+    size_t adopted = 0, gone = 0;
+    foreach(const auto &o, orphans) {
+        const state_journal::entry &e = o.second;
+        if (!e.pid_start || process_start_time(e.pid) != e.pid_start) { // Exited (and maybe its pid got reused).
+            gone++;
+            continue;
+        }
+        auto d = daemon_by_id.find(o.first);
+        if (d == daemon_by_id.end()) {
+            log(LOG_NOTICE, "Killing PID %d from old daemon \"%s\": it isn't configured any more\n", e.pid, o.first.c_str());
+            kill(e.pid, SIGTERM);
+            continue;
+        }
+        class daemon *daemon = d->second;
+        daemon->adopt(e.pid, e.pid_start, e.start_time, e.state == stopping);
+        adopted++;
+        if (!daemon->config.log_output && (daemon->config.collect_output || daemon->config.lastlog_size))
+            log(LOG_WARNING, "Adopted %s [%d], but its output was going to the old daemon-manager. It's lost until it restarts.\n",
+                daemon->id.c_str(), e.pid);
+    }
+    log(LOG_NOTICE, "Adopted %zd daemons left running by the last daemon-manager in %lldms (%zd had exited)\n", adopted,
+        (long long)(monotonic_ms() - start), gone);
+}
+
+static void journal_state(class daemon *d)
+{
+    if (!journal) return;
+    state_journal::entry e = { d->current.state, d->current.state == stopped ? 0 : d->current.pid, d->current.pid_start, d->current.respawn_time };
+    try { journal->note(d->id, e); }
+    catch(std::exception &e) {
+        log(LOG_ERR, "%s. There's no state journal any more, so if we crash the daemons will be started over.\n", e.what());
+        delete journal;
+        journal = NULL;
+    }
+}
+
+static void open_journal(vector<class daemon*> daemons)
+{
+    foreach(class daemon *d, daemons)
+        if (d->current.pid)
+            journal_state(d);
+    try { journal->open(); }
+    catch(std::exception &e) {
+        log(LOG_ERR, "Couldn't start the state journal (if we crash, the daemons will be started over): %s\n", e.what());
+        delete journal;
+        journal = NULL;
+    }
 }
 
 static void kill_unimported(map<string,string> data)
@@ -288,6 +546,12 @@ static void kill_unimported(map<string,string> data)
         kill(pid, SIGTERM);
     } else
         log(LOG_NOTICE, "Forgetting %s daemon \"%s\"\n", data["current.state"].c_str(), data["id"].c_str());
+    if (data.count("log.read_fd")) { // Nobody's going to read its output now.
+        close(atoi(data["log.read_fd"].c_str()));
+        close(atoi(data["log.write_fd"].c_str()));
+    }
+    if (data.count("log.ring_fd"))
+        close(atoi(data["log.ring_fd"].c_str()));
 }
 
 
@@ -320,92 +584,109 @@ pair<string,string> parse_json_key_value(string line)
 #undef inc
 }
 
-static void import_daemons(vector<class daemon*> daemons, FILE *f)
+// Returns false if it had to be killed off or forgotten.
+static bool import_daemon(map<string,string> data, map<string, class daemon*> &daemon_by_config)
 {
-    map<string, class daemon*> daemon_by_config;
-    foreach(class daemon *d, daemons)
-        daemon_by_config[d->config_file] = d;
-
-    char buffer[10000];
-    int red = fread(buffer, 1, sizeof(buffer), f);
-    fseek(f, 0, SEEK_SET);
-    log(LOG_INFO, "Importing: %.*s\n----\n", red, buffer);
-
+    class daemon *d = daemon_by_config.count(data["config_file"]) ? daemon_by_config[data["config_file"]] : NULL;
+    if (!d) {
+        kill_unimported(data);
+        return false;
+    }
+    try {
+        d->from_map(data);
+        log(LOG_DEBUG, "Reimported \"%s\"\n", d->id.c_str());
+        return true;
+    } catch(std::exception &e) {
+        log(LOG_ERR, "Couldn't reimport \"%s\": %s\n", d->id.c_str(), e.what());
+        kill_unimported(data);
+        return false;
+    }
+}
 
+// What versions before the binary snapshot passed along. Still read so that upgrading doesn't lose track of
+// everything.
+static void import_json(FILE *f, map<string, class daemon*> &daemon_by_config, size_t *found, size_t *imported)
+{
     int version;
     fscanf(f, "{ \"version\": %d\n", &version) == 1 || throw_str("Missing version");
     version == 1 || throw_str("Version == %d and not 1", version);
     fscanf(f, " \"daemons\": [\n");
-    char line[10000];
-    while (fgets(line, sizeof(line), f))
-        if (line[strspn(line, " ")] == '{') {
-            map<string,string> data;
-            while (fgets(line, sizeof(line), f))
-                if (line[strspn(line, " ")] != '}')
+    char *line = NULL;
+    size_t line_size = 0;
+    try {
+        while (getline(&line, &line_size, f) > 0)
+            if (line[strspn(line, " ")] == '{') {
+                map<string,string> data;
+                while (getline(&line, &line_size, f) > 0 && line[strspn(line, " ")] != '}')
                     data.insert(parse_json_key_value(line));
-                else {
-
-                    if (daemon_by_config[data["config_file"]]) {
-                        try {
-                            daemon_by_config[data["config_file"]]->from_map(data);
-                            log(LOG_INFO, "Reimport \"%s\" successfully.\n", daemon_by_config[data["config_file"]]->id.c_str());
-                        } catch(std::exception &e) {
-                            log(LOG_ERR, "Couldn't reimport \"%s\": %s\n", daemon_by_config[data["config_file"]]->id.c_str(), e.what());
-                            kill_unimported(data);
-                        }
-                    } else
-                        kill_unimported(data);
-
-                    break;
-                }
-        }
+                (*found)++;
+                *imported += import_daemon(data, daemon_by_config);
+            }
+    } catch (...) { free(line); throw; }
+    free(line);
 }
 
-static void export_daemons(vector<class daemon*> daemons, FILE *f)
-{
-    fprintf(f, "{\n"
-               "    \"version\": 1,\n");
-    fprintf(f, "    \"daemons\": [\n");
-    list<string> daemonrep;
-    foreach(class daemon *d, daemons) {
-        map<string,string> dmap = d->to_map();
-        list<string> keyval;
-        typedef pair<string,string> str_pair;
-        foreach(str_pair dr, dmap)
-            keyval.push_back(strprintf("            \"%s\": \"%s\"", json_escape(dr.first).c_str(), json_escape(dr.second).c_str()));
-        daemonrep.push_back(strprintf("        {\n"
-                                      "%s\n"
-                                      "        }", join(keyval, ",\n").c_str()));
-    }
-    fprintf(f, "%s\n", join(daemonrep, ",\n").c_str());
-    fprintf(f, "    ]\n"
-               "}\n");
-}
+// Clients that were connected when we re-exec()ed. They come along in the snapshot after the daemons.
+static list<map<string,string> > adopted_clients;
 
-static void reincarnate(vector<class daemon*> daemons)
+static void import_daemons(vector<class daemon*> daemons, int fd)
 {
-    FILE *f = NULL;
+    int64_t start_ms = monotonic_ms();
+    map<string, class daemon*> daemon_by_config;
+    foreach(class daemon *d, daemons)
+        daemon_by_config[d->config_file] = d;
+
+    size_t expected = 0, found = 0, imported = 0;
     try {
-        char Template[] = "/tmp/daemon-manager-running-daemons.XXXXXXXXXXXX";
-        int fd = mkstemp(Template);
-        if (fd == -1) throw_strerr("mkstemp() failed [%s]", Template);
-        unlink(Template);
-        FILE *f = fdopen(fd, "w+");
-        export_daemons(daemons, f);
-        fflush(f);
-        lseek(fd, 0, SEEK_SET);
-        setenv("dm_running_daemons_fd", strprintf("%d", fd).c_str(), 1) == 0 || throw_strerr("setenv() failed");
-        log(LOG_INFO, "Re-execing ourselves...\n");
-        execv(daemon_manager_exe_path, daemon_manager_argv);
-        throw_strerr("exec() failed");
-    } catch(std::exception &e) {
-        if (f)
+        if (snapshot_reader::is_snapshot(fd)) {
+            snapshot_reader snapshot(fd);
+            map<string,string> data;
+            expected = snapshot.count; // Before reading, so a snapshot that ends early still says how much is missing.
+            while (snapshot.next(data))
+                if (data.count("client.fd")) {
+                    adopted_clients.push_back(data); // Once the event loop is going. See adopt_client().
+                    expected--;
+                } else {
+                    found++;
+                    imported += import_daemon(data, daemon_by_config);
+                }
+        } else {
+            FILE *f = fdopen(dup(fd), "r");
+            if (!f) throw_strerr("fdopen() failed");
+            try { import_json(f, daemon_by_config, &found, &imported); }
+            catch (...) { fclose(f); throw; }
             fclose(f);
-        log(LOG_ERR, "Couldn't re-exec ourselves: %s\n", e.what());
+            expected = found;
+        }
+    } catch(std::exception &e) {
+        log(LOG_ERR, "Couldn't import old state: %s\n", e.what());
+        log(LOG_ERR, "Daemons from there on have been forgotten--kill their pids manually. Sorry.\n");
     }
+    size_t total = max(expected, found);
+    log(imported == total ? LOG_INFO : LOG_WARNING, "Imported %zd of %zd daemons in %lldms (%zd lost)\n",
+        imported, total, (long long)(monotonic_ms() - start_ms), total - imported);
 }
 
-static int open_server_socket()
+static const char export_header[] = "{\n"
+                                   "    \"version\": 1,\n"
+                                   "    \"daemons\": [\n";
+static const char export_footer[] = "\n"
+                                   "    ]\n"
+                                   "}\n";
+
+static string export_daemon(class daemon *d)
+{
+    map<string,string> dmap = d->to_map();
+    list<string> keyval;
+    typedef pair<string,string> str_pair;
+    foreach(str_pair dr, dmap)
+        keyval.push_back(strprintf("            \"%s\": \"%s\"", json_escape(dr.first).c_str(), json_escape(dr.second).c_str()));
+    return strprintf("        {\n"
+                     "%s\n"
+                     "        }", join(keyval, ",\n").c_str());
+}
+
+static int open_server_socket(int backlog)
 {
     struct sockaddr_un addr = command_sock_addr();
     struct stat st;
@@ -415,15 +696,34 @@ static int open_server_socket()
     int command_socket = socket(PF_LOCAL, SOCK_STREAM /*SOCK_DGRAM*/, 0);
     if (command_socket < 0) throw_strerr("socket() failed");
     fcntl(command_socket, F_SETFD, FD_CLOEXEC)                  == -1 && throw_strerr("Couldn't set socket to close on exec");
+    fcntl(command_socket, F_SETFL, O_NONBLOCK)                  == -1 && throw_strerr("Couldn't set socket to non-blocking");
     ::bind(command_socket, (struct sockaddr*) &addr, sizeof(sa_family_t) + strlen(addr.sun_path) + 1)
                                                                  == 0 || throw_strerr("Binding to socket %s failed", addr.sun_path);
-    listen(command_socket, 1)                                    == 0 || throw_strerr("listen(%s) failed", addr.sun_path);
+    listen(command_socket, backlog)                              == 0 || throw_strerr("listen(%s) failed", addr.sun_path);
 
     // Needs to be world read/writable so that all users can connect (we authrorize them when they connect)
     chmod(addr.sun_path, 0777)                                   == 0 || throw_strerr("chmod %s, 0777", addr.sun_path);
     return command_socket;
 }
 
+// The old us left it open for us, so it never goes away and nobody trying to connect during the re-exec notices.
+static int inherit_server_socket(int backlog)
+{
+    int command_socket = atoi(getenv("dm_command_socket_fd"));
+    unsetenv("dm_command_socket_fd");
+    struct stat st;
+    fstat(command_socket, &st) == 0 && S_ISSOCK(st.st_mode)      || throw_str("fd %d isn't a socket", command_socket); // So not ours to close.
+    try {
+        fcntl(command_socket, F_SETFD, FD_CLOEXEC)              == -1 && throw_strerr("Couldn't set socket to close on exec");
+        fcntl(command_socket, F_SETFL, O_NONBLOCK)              == -1 && throw_strerr("Couldn't set socket to non-blocking");
+        listen(command_socket, backlog)                          == 0 || throw_strerr("listen() failed"); // In case the config changed.
+    } catch (...) {
+        close(command_socket); // Before open_server_socket() replaces it.
+        throw;
+    }
+    return command_socket;
+}
+
 int time_to_die;
 static void handle_sig_term_or_int(int sig)
 {
@@ -442,27 +742,417 @@ static void handle_sig_hup(int)
     hup_two_three_four = true;
 }
 
+// Responses are streamed out in pieces about this big so that a huge status/export doesn't have to sit in
+// memory all at once. We also stop reading commands from a client that isn't reading its responses.
+static const size_t client_output_buffer = 64*1024;
+static const size_t client_input_limit   = 64*1024;
+
+// A "watch" command. Events pile up in the queue until the client's socket can take them. Someone who isn't
+// keeping up loses events rather than making us hold on to an ever growing pile of them--they get told how many
+// they missed so they know to go look at "status-json".
+struct subscription {
+    class user *user;
+    string id;            // Just this daemon, or everything they can manage if empty.
+    deque<string> queue;
+    size_t dropped;
+};
+static list<weak_ptr<subscription> > subscriptions; // The clients' response_streams own them.
+static const size_t subscription_queue_limit = 1000;
+static bool subscriptions_pending; // Something got queued since we last flushed the subscribers.
+
+static string event_json(class daemon *d, const char *event, int value)
+{
+    string json = strprintf("{\"time\": %lld, \"event\": \"%s\"", (long long)time(NULL), event);
+    if (!d)
+        return json + strprintf(", \"dropped\": %d}\n", value);
+    json += strprintf(", \"id\": \"%s\", \"state\": \"%s\", \"pid\": %d",
+                      json_escape(d->id).c_str(), d->state_str().c_str(), d->current.pid);
+    if (string(event) == "exit" && value >= 0 && WIFEXITED(value))   json += strprintf(", \"status\": %d", WEXITSTATUS(value));
+    if (string(event) == "exit" && value >= 0 && WIFSIGNALED(value)) json += strprintf(", \"signal\": %d", WTERMSIG(value));
+    if (string(event) == "cooldown")                                 json += strprintf(", \"cooldown\": %d", value);
+    return json + "}\n";
+}
+
+static void broadcast_event(class daemon *d, const char *event, int value)
+{
+    string json;
+    for (auto s = subscriptions.begin(); s != subscriptions.end(); ) {
+        shared_ptr<subscription> sub = s->lock();
+        if (!sub) {
+            s = subscriptions.erase(s);
+            continue;
+        }
+        s++;
+        if (!sub->user->can_manage.count(d->user) || (!sub->id.empty() && sub->id != d->id))
+            continue;
+        if (sub->queue.size() >= subscription_queue_limit) {
+            sub->dropped++;
+            continue;
+        }
+        if (sub->dropped)
+            sub->queue.push_back(event_json(NULL, "dropped", sub->dropped));
+        sub->dropped = 0;
+        if (json.empty())
+            json = event_json(d, event, value); // Only bother if someone wants it.
+        sub->queue.push_back(json);
+        subscriptions_pending = true;
+    }
+}
+
+static response_stream subscribe(user *user, string id)
+{
+    shared_ptr<subscription> sub(new subscription);
+    sub->user = user;
+    sub->id = id;
+    sub->dropped = 0;
+    subscriptions.push_back(sub);
+    return [sub](string &out) {
+        for (; !sub->queue.empty() && out.size() < client_output_buffer; sub->queue.pop_front())
+            out += sub->queue.front();
+        if (sub->queue.empty() && sub->dropped) {
+            out += event_json(NULL, "dropped", sub->dropped);
+            sub->dropped = 0;
+        }
+        return true; // Forever. They're done when they hang up.
+    };
+}
+
+struct client {
+    class user *user;
+    string in;            // Commands we haven't gotten to yet, one per line.
+    string out;           // Response bytes the socket hasn't taken yet.
+    response_stream more; // The rest of a long response that hasn't been generated yet.
+    bool watching;        // more is a "watch" (of watch_id), so it never finishes.
+    bool eof;             // They've sent everything they're going to, but may still be waiting for the answers.
+    string watch_id;
+};
+static map<int,client> clients;
+static map<uid_t,user*> users_by_id;
+
+
+static int listen_socket = -1;
+
+// Held open so that when we're out of fds we can close it, accept() whoever is knocking, tell them to go away,
+// and get the fd back. Otherwise they'd sit in the backlog, the socket would stay readable and we'd spin.
+static int reserve_fd = -1;
+// If we couldn't get it back, the backlog has to wait until an fd frees up (or a second has gone by).
+static bool out_of_fds;
+static timer_queue::timer_id out_of_fds_timer;
+
+static void resume_accepting(event_loop *events)
+{
+    timers.cancel(out_of_fds_timer);
+    out_of_fds = false;
+    if (reserve_fd < 0)
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (clients.size() < max_clients)
+        events->set_events(listen_socket, event_loop::ev_read);
+}
+
+static void close_client(event_loop *events, int client)
+{
+    events->remove_fd(client);
+    close(client);
+    clients.erase(client);
+    if (out_of_fds || clients.size() == max_clients - 1) // We stopped accepting--start again.
+        resume_accepting(events);
+}
+
+// Every response ends with a NUL so that dmctl knows when it has seen all of it.
+static void flush_client(event_loop *events, int fd, vector<class daemon*> *daemons)
+{
+    client &c = clients[fd];
+    while (1) {
+        while (c.more && c.out.size() < client_output_buffer) {
+            size_t before = c.out.size();
+            if (!c.more(c.out)) {
+                c.more = nullptr;
+                c.out += '\0';
+            } else if (c.out.size() == before)
+                break; // A "watch" that's all caught up.
+        }
+
+        // Only start the next command once the last response is completely out the door.
+        size_t eol;
+        if (c.out.empty() && !c.more && (eol = c.in.find('\n')) != c.in.npos) {
+            string command = c.in.substr(0, eol);
+            c.in.erase(0, eol+1);
+            c.out = do_command(command, c.user, daemons, &c.more);
+            if (!c.more)
+                c.out += '\0';
+            size_t space = command.find(' ');
+            if (c.more && command.substr(0, space) == "watch") {
+                c.watching = true;
+                c.watch_id = space == command.npos ? "" : command.substr(space+1);
+            }
+            continue;
+        }
+        if (c.out.empty())
+            break;
+
+        ssize_t wrote = write(fd, c.out.data(), c.out.size());
+        if (wrote < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        if (wrote < 0) {
+            log(LOG_WARNING, "Couldn't write response to client socket %d: %s\n", fd, strerror(errno));
+            return close_client(events, fd);
+        }
+        log(LOG_DEBUG, "Wrote %zd bytes of response to client socket %d\n", wrote, fd);
+        c.out.erase(0, wrote);
+    }
+    if (c.eof && c.out.empty() && (!c.more || c.watching))
+        return close_client(events, fd); // Everything they asked has been answered.
+    events->set_events(fd, !c.out.empty() ? event_loop::ev_write : c.eof ? 0 : event_loop::ev_read);
+}
+
+static void handle_client(event_loop *events, int fd, int what, vector<class daemon*> *daemons)
+{
+    client &c = clients[fd];
+    if (what & event_loop::ev_read) {
+        char buf[1000];
+        int red = read(fd, buf, sizeof(buf));
+        if (red > 0) {
+            c.in.append(buf, red); // Only whole lines get run, so a command that comes in pieces waits for the rest.
+            if (c.in.size() > client_input_limit) {
+                log(LOG_WARNING, "Client socket %d sent %zd bytes of commands without reading the responses. Hanging up.\n", fd, c.in.size());
+                return close_client(events, fd);
+            }
+        }
+        if (red == 0 && !c.eof) {
+            // Done sending. Whatever's left is the last command, newline or not.
+            if (!c.in.empty() && c.in.back() != '\n')
+                c.in += '\n';
+            c.eof = true;
+        }
+    }
+    // A hangup with nothing left to read means they're gone for good, not just done sending.
+    if (what & event_loop::ev_error || what & event_loop::ev_hangup && !(what & event_loop::ev_read))
+        return close_client(events, fd);
+    flush_client(events, fd, daemons);
+}
+
+static int accept_nonblocking(int socket)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+#ifdef __linux__
+    return accept4(socket, (struct sockaddr*) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client = accept(socket, (struct sockaddr*) &addr, &addr_len);
+    if (client >= 0) {
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        fcntl(client, F_SETFL, O_NONBLOCK);
+    }
+    return client;
+#endif
+}
+
+static void refuse_client(int client, string why)
+{
+    log(LOG_WARNING, "Command socket: %s\n", why.c_str());
+    string resp = "ERR: "+why+"\n"+'\0';
+    ssize_t wrote = write(client, resp.c_str(), resp.length());
+    if (wrote < 0)                       log(LOG_WARNING, "Couldn't write err to client socket %d: %s\n", client, strerror(errno));
+    if (wrote != (ssize_t)resp.length()) log(LOG_WARNING, "Couldn't write err to client socket %d (%zd vs %lu)\n", client, wrote, resp.length());
+    close(client);
+}
+
+static void accept_clients(event_loop *events, int command_socket_fd, vector<class daemon*> *daemons)
+{
+    // Take everyone who's waiting, not just one per trip through the loop--during a storm there are a lot of them.
+    while (clients.size() < max_clients) {
+        int client = accept_nonblocking(command_socket_fd);
+        if (client == -1 && (errno == EMFILE || errno == ENFILE) && reserve_fd >= 0) {
+            close(reserve_fd);
+            client = accept_nonblocking(command_socket_fd);
+            if (client >= 0)
+                refuse_client(client, "daemon-manager is out of file descriptors. Try again later.");
+            reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (client >= 0) continue;
+            return; // accept() checks for a free fd before it checks for a connection, so the backlog may be empty.
+        }
+        if (client == -1 && (errno == EMFILE || errno == ENFILE)) { // And no reserve to trade in.
+            log(LOG_WARNING, "Out of file descriptors, not accepting any clients for now\n");
+            out_of_fds = true;
+            events->set_events(command_socket_fd, 0);
+            timers.cancel(out_of_fds_timer);
+            out_of_fds_timer = timers.add_after(1000, [events]() { out_of_fds_timer = 0; resume_accepting(events); });
+            return;
+        }
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log(LOG_WARNING, "accept() from command socket failed: %s\n", strerror(errno));
+            return;
+        }
+        uid_t uid;
+        try {
+            uid = get_peer_uid(client);
+            if (!users_by_id.count(uid)) {
+                throw_str("Not authorized. \"%s\" (uid %d) is not in the daemon-manager.conf file", name_from_uid(uid).c_str(), uid);
+            }
+        } catch(std::exception &e) {
+            refuse_client(client, e.what());
+            continue;
+        }
+        clients[client].user = users_by_id[uid];
+        events->add_fd(client, event_loop::ev_read, [events, daemons](int fd, int what) { handle_client(events, fd, what, daemons); });
+    }
+    // Leave the rest in the listen backlog. close_client() turns us back on once someone hangs up.
+    log(LOG_NOTICE, "%zd clients connected, not accepting any more for now\n", clients.size());
+    events->set_events(command_socket_fd, 0);
+}
+
+static void adopt_client(event_loop *events, map<string,string> data, vector<class daemon*> *daemons)
+{
+    int fd = atoi(data["client.fd"].c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    uid_t uid;
+    try {
+        uid = get_peer_uid(fd);
+        if (!users_by_id.count(uid)) throw_str("uid %d isn't in the daemon-manager.conf file any more", uid);
+    } catch(std::exception &e) {
+        log(LOG_NOTICE, "Hanging up on client socket %d from before the re-exec: %s\n", fd, e.what());
+        close(fd);
+        return;
+    }
+    client &c = clients[fd];
+    c.user = users_by_id[uid];
+    if (data.count("client.watch")) { // They already got their "OK".
+        c.watching = true;
+        c.watch_id = data["client.watch"];
+        c.more = subscribe(c.user, c.watch_id);
+    }
+    c.in = data["client.in"]; // Commands that came in behind the one that was answered before the re-exec.
+    events->add_fd(fd, event_loop::ev_read, [events, daemons](int fd, int what) { handle_client(events, fd, what, daemons); });
+    flush_client(events, fd, daemons); // They're waiting on those, so they won't be sending anything to wake us.
+}
+
+// A client in the middle of a response can't be handed over--the rest of it only exists in here. Give them a
+// moment to take it, and hang up on anyone who doesn't. Commands they've sent that we haven't started on yet
+// can be, so they go in the snapshot. Same goes for the events still queued up for a watcher: the new us starts
+// them a fresh subscription, so they get pushed out now along with everything else.
+static void finish_responses(event_loop *events, vector<class daemon*> *daemons)
+{
+    int64_t deadline = monotonic_ms() + 1000;
+    vector<int> watchers;
+    foreach(const auto &c, clients)
+        if (c.second.watching)
+            watchers.push_back(c.first);
+    foreach(int fd, watchers)
+        flush_client(events, fd, daemons); // Moves their queue into out, where the loop below will see it.
+    while (1) {
+        vector<struct pollfd> busy;
+        foreach(const auto &c, clients)
+            if (!c.second.out.empty() || c.second.more && !c.second.watching)
+                busy.push_back((struct pollfd) { c.first, POLLOUT, 0 });
+        if (busy.empty())
+            return;
+        int64_t left = deadline - monotonic_ms();
+        if (left <= 0) {
+            foreach(const auto &p, busy) {
+                log(LOG_WARNING, "Client socket %d didn't take its whole response before the re-exec. Hanging up.\n", p.fd);
+                close_client(events, p.fd);
+            }
+            return;
+        }
+        poll(&busy[0], busy.size(), left);
+        foreach(const auto &p, busy)
+            if (p.revents)
+                flush_client(events, p.fd, daemons);
+    }
+}
+
+// The command socket and everyone connected to it come along too (as fds the new us finds in the snapshot
+// and environment), so clients never see it go away.
+static void keep_sockets_across_exec(bool keep)
+{
+    fcntl(listen_socket, F_SETFD, keep ? 0 : FD_CLOEXEC);
+    foreach(const auto &c, clients)
+        fcntl(c.first, F_SETFD, keep ? 0 : FD_CLOEXEC);
+}
+
+static void reincarnate(event_loop *events, vector<class daemon*> daemons)
+{
+    int64_t start = monotonic_ms();
+    int fd = -1;
+    try {
+        finish_spawner_requests();
+        finish_responses(events, &daemons);
+        fd = snapshot_fd();
+        snapshot_writer snapshot(fd, daemons.size() + clients.size());
+        foreach(class daemon *d, daemons)
+            snapshot.add(d->to_map());
+        foreach(const auto &c, clients) {
+            map<string,string> data;
+            data["client.fd"] = strprintf("%d", c.first);
+            if (c.second.watching)
+                data["client.watch"] = c.second.watch_id;
+            if (!c.second.in.empty())
+                data["client.in"] = c.second.in;
+            snapshot.add(data);
+        }
+        snapshot.finish();
+        setenv("dm_running_daemons_fd", strprintf("%d", fd).c_str(), 1)        == 0 || throw_strerr("setenv() failed");
+        setenv("dm_command_socket_fd", strprintf("%d", listen_socket).c_str(), 1) == 0 || throw_strerr("setenv() failed");
+        setenv("dm_reexec_start_ms", strprintf("%lld", (long long)start).c_str(), 1) == 0 || throw_strerr("setenv() failed");
+        log(LOG_INFO, "Re-execing ourselves (with %zd clients connected)...\n", clients.size());
+        foreach(class daemon *d, daemons) // The daemons are still writing into these.
+            if (d->collector) d->collector->keep_across_exec(true);
+        keep_sockets_across_exec(true);
+        execv(daemon_manager_exe_path, daemon_manager_argv);
+        keep_sockets_across_exec(false);
+        foreach(class daemon *d, daemons)
+            if (d->collector) d->collector->keep_across_exec(false);
+        unsetenv("dm_command_socket_fd");
+        unsetenv("dm_reexec_start_ms");
+        throw_strerr("exec() failed");
+    } catch(std::exception &e) {
+        if (fd >= 0)
+            close(fd);
+        log(LOG_ERR, "Couldn't re-exec ourselves: %s\n", e.what());
+    }
+}
+
 static void select_loop(vector<user*> users, vector<class daemon*> daemons, int command_socket_fd)
 {
-    signal(SIGCHLD, handle_sig_child);
-    signal(SIGTERM, handle_sig_term_or_int);
-    signal(SIGINT,  handle_sig_term_or_int);
-    signal(SIGHUP,  handle_sig_hup);
+    event_loop *events = main_loop;
+    try {
+        events->add_signal(SIGCHLD, handle_sig_child);
+        events->add_signal(SIGTERM, handle_sig_term_or_int);
+        events->add_signal(SIGINT,  handle_sig_term_or_int);
+        events->add_signal(SIGHUP,  handle_sig_hup);
+        events->add_fd(command_socket_fd, event_loop::ev_read, [events, &daemons](int fd, int) { accept_clients(events, fd, &daemons); });
+        listen_socket = command_socket_fd;
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (watcher->fd() >= 0)
+            events->add_fd(watcher->fd(), event_loop::ev_read, [&users, &daemons](int, int) { handle_config_changes(users, &daemons); });
+    } catch(std::exception &e) {
+        log(LOG_ERR, "Couldn't set up event loop: %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
     signal(SIGPIPE, SIG_IGN);
-    typedef map<int,user*>::iterator fd_map_it;
-
-    map<int,user*> clients;
-    map<uid_t,user*> users_by_id;
 
     foreach(class user *u, users)
         users_by_id[u->uid] = u;
+    state_change_hook = [](class daemon *d, const char *event, int value) {
+        journal_state(d);
+        broadcast_event(d, event, value);
+    };
+    foreach(const auto &data, adopted_clients)
+        adopt_client(events, data, &daemons);
+    adopted_clients.clear();
+
+    autostart(daemons); // Now that there's an event loop to hear back from the exec()s.
 
     while (1) {
         // Handle signals:
         if (hup_two_three_four) {
             log(LOG_DEBUG, "SIGHUP\n");
             hup_two_three_four = false;
-            reincarnate(daemons);
+            log_nss_cache_stats();
+            nss_cache_flush(); // The new us starts with an empty cache anyway, but in case the exec fails...
+            reincarnate(events, daemons);
         }
         if (child_mortality) {
             log(LOG_DEBUG, "SIGCHILD\n");
@@ -479,7 +1169,8 @@ static void select_loop(vector<user*> users, vector<class daemon*> daemons, int
             // we're waiting for something else to stop.
             bool quiesced = true;
             foreach(class daemon *d, daemons) {
-                if (d->current.state == running || d->current.state == coolingdown)
+                if (d->current.state == running || d->current.state == starting || d->current.state == coolingdown ||
+                    d->current.state == queued)
                     d->stop();
                 if (d->current.state != stopped)
                     quiesced = false;
@@ -490,120 +1181,57 @@ static void select_loop(vector<user*> users, vector<class daemon*> daemons, int
             }
         }
 
+        start_queued_daemons();
+
         // Wait for something to happen.
-        struct pollfd fd[1/*command_socket*/ + clients.size()];
-        int nfds = 0;
+        events->wait(timers.next_deadline());
 
-        fd[nfds].fd = command_socket_fd;
-        fd[nfds++].events = POLLIN;
-        for (fd_map_it cli = clients.begin(); cli != clients.end(); cli++, nfds++) {
-            fd[nfds].fd = cli->first;
-            fd[nfds].events = POLLIN;
-        }
+        cull_daemons(users, &daemons);
 
-        time_t wait_time=-1; // infinite
-        foreach(class daemon *d, daemons)
-            if (d->current.state == coolingdown)
-                wait_time = wait_time < 0 ? d->cooldown_remaining() * 1000
-                                          : min(wait_time, d->cooldown_remaining() * 1000);
-
-        int got = poll(fd, nfds, wait_time);
-
-        // Cull daemons whose config files have been deleted
-        for (vector<class daemon*>::iterator d = daemons.begin(); d != daemons.end();)
-            if (((*d)->current.state == stopped || (*d)->current.state == coolingdown) && !(*d)->exists()) {
-                log(LOG_INFO, "Culling %s because %s has disappeared.\n", (*d)->id.c_str(), (*d)->config_file.c_str());
-                delete *d;
-                d = daemons.erase(d);
-            } else
-                d++;
-
-        // Deal with input on the command sockets
-        if (got > 0) {
-            for (size_t i=0; i<lengthof(fd); i++) {
-                if (fd[i].revents & POLLIN) {
-                    if (fd[i].fd == command_socket_fd) {
-                        struct sockaddr_un addr;
-                        socklen_t addr_len = sizeof(addr);
-                        int client = accept(command_socket_fd, (struct sockaddr*) &addr, &addr_len);
-                        if (client == -1) {
-                            log(LOG_WARNING, "accept() from command socket failed: %s\n", strerror(errno));
-                            continue;
-                        }
-                        fcntl(client, F_SETFD, FD_CLOEXEC);
-                        fcntl(client, F_SETFL, O_NONBLOCK);
-                        uid_t uid;
-                        try {
-                            uid = get_peer_uid(client);
-                            if (!users_by_id.count(uid)) {
-                                struct passwd *p = getpwuid(uid);
-                                throw_str("Not authorized. \"%s\" (uid %d) is not in the daemon-manager.conf file", p ? p->pw_name : "unknown user", uid);
-                            }
-                        } catch(std::exception &e) {
-                            log(LOG_WARNING, "Command socket: %s\n", e.what());
-                            string resp = string("ERR: ")+e.what()+"\n";
-                            ssize_t wrote = write(client, resp.c_str(), resp.length());
-                            if (wrote < 0)                       log(LOG_WARNING, "Couldn't write err to client socket %d: %s\n", client, strerror(errno));
-                            if (wrote != (ssize_t)resp.length()) log(LOG_WARNING, "Couldn't write err to client socket %d (%zd vs %lu)\n", client, wrote, resp.length());
-                            close(client);
-                            continue;
-                        }
-                        clients[client] = users_by_id[uid];
-                    } else if (clients.count(fd[i].fd)) {
-                        char buf[1000];
-                        int red = read(fd[i].fd, buf, sizeof(buf)-1);
-                        if (red) {
-                            if (buf[red-1] == '\n') red--;
-                            buf[red] = '\0';
-                            for (char *r = buf, *cmd; cmd = strsep(&r, "\n"); ) {
-                                string resp = do_command(cmd, clients[fd[i].fd], &daemons);
-                                int wrote = write(fd[i].fd, resp.c_str(), resp.length());
-                                log(LOG_DEBUG, "Wrote %d bytes of response: %s\n", wrote, resp.c_str());
-                            }
-                        }
-                    }
-                }
-                if (fd[i].revents & POLLHUP && clients.count(fd[i].fd)) {
-                    close(fd[i].fd);
-                    clients.erase(fd[i].fd);
-                }
-            }
-        }
         // Reap/respawn our children
-        for (int kid; (kid = waitpid(-1, NULL, WNOHANG)) > 0;) {
+        int status;
+        for (int kid; (kid = waitpid(-1, &status, WNOHANG)) > 0;) {
             log(LOG_NOTICE, "Child %d exited\n", kid);
-            foreach(class daemon *d, daemons)
-                if (d->current.pid == kid) {
-                    if (d->current.state == running)
-                        try { d->respawn(); }
-                        catch(std::exception &e) { log(LOG_ERR, "Couldn't respawn %s: %s\n", d->id.c_str(), e.what()); }
-                    else
-                        d->reap();
-                    break;
-                }
-        }
-        // Start up daemons that have cooled down
-        foreach(class daemon *d, daemons)
-            if (d->current.state == coolingdown && d->cooldown_remaining() == 0) {
-                log(LOG_INFO, "Cooldown time has arrived for %s\n", d->id.c_str());
-                try { d->start(true); }
-                catch(std::exception &e) { log(LOG_ERR, "Couldn't respawn cooled-down %s: %s\n", d->id.c_str(), e.what()); }
+            class daemon *d = daemon_by_pid(kid);
+            if (!d) {
+                unclaimed_child_exited(kid, status);
+                continue;
             }
+            try { d->exited(status); }
+            catch(std::exception &e) { log(LOG_ERR, "Couldn't respawn %s: %s\n", d->id.c_str(), e.what()); }
+        }
+        // Start up daemons that have cooled down (and anything else whose time has come)
+        timers.run_expired();
+
+        // Send out whatever happened to the "watch"ers.
+        if (subscriptions_pending) {
+            subscriptions_pending = false;
+            vector<int> fds;
+            foreach(const auto &c, clients)
+                if (c.second.more && c.second.out.empty())
+                    fds.push_back(c.first);
+            foreach(int fd, fds)
+                flush_client(events, fd, &daemons);
+        }
     }
 }
 
-static vector<class daemon*> manageable_by_user(user *user, vector<class daemon*> daemons)
+static vector<class daemon*> manageable_by_user(user *user)
 {
     vector<class daemon*> manageable;
-    foreach(class daemon *d, daemons)
-        foreach(class user *u, user->manages)
-            if (d->user == u) {
-                manageable.push_back(d);
-                break;
-            }
+    foreach(class user *u, user->manages)
+        manageable.insert(manageable.end(), u->daemons.begin(), u->daemons.end());
     return manageable;
 }
 
+static class daemon *find_manageable(user *user, string id)
+{
+    auto d = daemon_by_id.find(id);
+    if (d == daemon_by_id.end() || !user->can_manage.count(d->second->user))
+        return NULL;
+    return d->second;
+}
+
 static string daemon_id_list(vector<class daemon*> daemons)
 {
     string resp = "";
@@ -627,73 +1255,238 @@ static string elapsed(time_t seconds)
     return join(s, "");
 }
 
-static string do_command(string command_line, user *user, vector<class daemon*> *daemons)
+// Like 1.2M. Bytes per second, here.
+static string human_rate(double bytes)
+{
+    const char *unit = "KMGT";
+    if (bytes < 1000) return strprintf("%.0f", bytes);
+    for (bytes /= 1024; bytes >= 1000 && unit[1]; bytes /= 1024)
+        unit++;
+    return strprintf(bytes < 10 ? "%.1f%c" : "%.0f%c", bytes, *unit);
+}
+
+static string status_row(class daemon *d)
+{
+    const proc_usage &u = d->usage;
+    return strprintf("%-30s %-15s %9d %8zd %8s %8s %8s %6s %6s %5s %8s\n",
+                     d->id.c_str(),
+                     d->state_str().c_str(),
+                     d->current.pid,
+                     d->current.respawns,
+                     elapsed(d->cooldown_remaining()).c_str(),
+                     elapsed(d->current.pid ? time(NULL) - d->current.respawn_time : 0).c_str(),
+                     elapsed(d->current.pid ? time(NULL) - d->current.start_time   : 0).c_str(),
+                     u.sampled ? strprintf("%.*f%%", u.cpu_percent < 10 ? 1 : 0, u.cpu_percent).c_str() : "-",
+                     u.sampled ? human_rate(u.rss).c_str() : "-",
+                     u.sampled ? strprintf("%d", u.fds).c_str() : "-",
+                     d->collector ? (human_rate(d->collector->bytes_per_sec()) + "/s").c_str() : "-")
+        + d->get_and_clear_whines();
+}
+
+// Generates the status table a few rows at a time. Cursors rather than a list of daemons, since the daemons
+// can be culled out from under us while the client is slowly reading.
+static response_stream status_rows(user *user)
+{
+    size_t u = 0, d = 0;
+    return [user, u, d](string &out) mutable {
+        for (int rows = 0; u < user->manages.size() && rows < 100; ) {
+            vector<class daemon*> &daemons = user->manages[u]->daemons;
+            if (d < daemons.size()) {
+                out += status_row(daemons[d++]);
+                rows++;
+            } else {
+                u++;
+                d = 0;
+            }
+        }
+        return u < user->manages.size();
+    };
+}
+
+// "status-json" is for programs. It skips the table formatting, returns the raw fields from daemon::to_map()
+// (plus how much cooldown is left and when that is), and can be filtered so pollers only get (and we only generate) what they
+// asked for.
+static const vector<string> status_json_fields = { "id", "name", "user", "config_file", "current.state", "current.pid",
+                                                   "current.respawns", "current.cooldown", "current.cooldown_start",
+                                                   "cooldown_remaining", "next_attempt", "current.start_time",
+                                                   "current.respawn_time", "output_bytes", "output_rate", "cpu_percent",
+                                                   "cpu_ms", "rss", "fds", "processes" };
+static bool status_json_numeric(const string &field)
+{
+    return (field.compare(0, 8, "current.") == 0 && field != "current.state") || field == "cooldown_remaining" ||
+           field == "next_attempt" || field == "output_bytes" || field == "output_rate" || field == "cpu_percent" ||
+           field == "cpu_ms" || field == "rss" || field == "fds" || field == "processes";
+}
+
+struct status_filter {
+    set<string> states;    // Empty means all of them.
+    string user;
+    string id;
+    string prefix;
+    vector<string> fields; // Empty means status_json_fields.
+};
+
+static status_filter parse_status_filter(string arg)
+{
+    status_filter filter;
+    vector<string> terms;
+    split(terms, arg, " ");
+    foreach(string term, terms) {
+        if (term.empty()) continue;
+        size_t eq = term.find('=');
+        if (eq == term.npos || eq == term.length()-1) throw_str("bad filter \"%s\"", term.c_str());
+        string key = term.substr(0, eq), value = term.substr(eq+1);
+        if (key == "state") {
+            vector<string> states;
+            split(states, value, ",");
+            foreach(string state, states) {
+                if (find(_state_str, _state_str + lengthof(_state_str), state) == _state_str + lengthof(_state_str))
+                    throw_str("unknown state \"%s\"", state.c_str());
+                filter.states.insert(state);
+            }
+        }
+        else if (key == "user")   filter.user = value;
+        else if (key == "id")     filter.id = value;
+        else if (key == "prefix") filter.prefix = value;
+        else if (key == "fields") {
+            split(filter.fields, value, ",");
+            foreach(string field, filter.fields)
+                if (find(status_json_fields.begin(), status_json_fields.end(), field) == status_json_fields.end())
+                    throw_str("unknown field \"%s\"", field.c_str());
+        }
+        else throw_str("unknown filter \"%s\"", key.c_str());
+    }
+    return filter;
+}
+
+static bool status_filter_matches(const status_filter &filter, class daemon *d)
+{
+    return (filter.states.empty() || filter.states.count(d->state_str())) &&
+           (filter.id.empty()     || d->id == filter.id) &&
+           (filter.prefix.empty() || d->id.compare(0, filter.prefix.length(), filter.prefix) == 0);
+}
+
+static string status_json(class daemon *d, const vector<string> &fields)
+{
+    map<string,string> dmap = d->to_map();
+    dmap["cooldown_remaining"] = strprintf("%lld", (long long)d->cooldown_remaining());
+    dmap["next_attempt"]       = strprintf("%lld", d->current.state == coolingdown ? (long long)(time(NULL) + d->cooldown_remaining()) : 0LL);
+    dmap["output_bytes"]       = strprintf("%llu", d->collector ? (unsigned long long)d->collector->bytes_total : 0ULL);
+    dmap["output_rate"]        = strprintf("%.0f", d->collector ? d->collector->bytes_per_sec() : 0.0);
+    dmap["cpu_percent"]        = strprintf("%.1f", d->usage.cpu_percent);
+    dmap["cpu_ms"]             = strprintf("%llu", (unsigned long long)d->usage.cpu_ms);
+    dmap["rss"]                = strprintf("%llu", (unsigned long long)d->usage.rss);
+    dmap["fds"]                = strprintf("%d", d->usage.fds);
+    dmap["processes"]          = strprintf("%d", d->usage.processes);
+    list<string> keyval;
+    foreach(string field, fields.empty() ? status_json_fields : fields)
+        keyval.push_back(status_json_numeric(field) ? strprintf("\"%s\": %s",     json_escape(field).c_str(), dmap[field].c_str())
+                                                    : strprintf("\"%s\": \"%s\"", json_escape(field).c_str(), json_escape(dmap[field]).c_str()));
+    return "{" + join(keyval, ", ") + "}";
+}
+
+// Same cursor scheme as status_rows(), producing a JSON array with one daemon per line.
+static response_stream status_json_rows(user *user, status_filter filter)
+{
+    size_t u = 0, d = 0, matched = 0;
+    return [user, filter, u, d, matched](string &out) mutable {
+        for (size_t chunk_end = matched + 100; u < user->manages.size() && matched < chunk_end; ) {
+            class user *owner = user->manages[u];
+            if (d < owner->daemons.size() && (filter.user.empty() || owner->name == filter.user)) {
+                class daemon *daemon = owner->daemons[d++];
+                if (status_filter_matches(filter, daemon))
+                    out += (matched++ ? ",\n" : "") + status_json(daemon, filter.fields);
+            } else {
+                u++;
+                d = 0;
+            }
+        }
+        if (u < user->manages.size())
+            return true;
+        out += matched ? "\n]\n" : "]\n";
+        return false;
+    };
+}
+
+static string do_command(string command_line, user *user, vector<class daemon*> *daemons, response_stream *more)
 {
   try {
-    vector<class daemon*> manageable = manageable_by_user(user, *daemons);
     size_t space = command_line.find_first_of(" ");
     string cmd = command_line.substr(0, space);
     string arg = space != command_line.npos ? command_line.substr(space+1, command_line.length()) : "";
     log(LOG_DEBUG, "line: \"%s\" cmd: \"%s\", arg: \"%s\"\n", command_line.c_str(), cmd.c_str(), arg.c_str());
 
-    const string valid_commands[] = { "list", "status", "rescan", "start", "stop", "restart", "logfile", "configfile", "pid", "export" };
+    const string valid_commands[] = { "list", "status", "rescan", "start", "stop", "restart", "logfile", "lastlog", "configfile", "pid", "export", "status-json", "watch" };
 
     if (find(valid_commands, valid_commands + lengthof(valid_commands), cmd) == valid_commands + lengthof(valid_commands) && cmd.compare(0,5,"kill-") != 0)
         throw_str("bad command \"%s\"", cmd.c_str());
 
     if (cmd == "list") {
-        return "OK: " + daemon_id_list(manageable) + "\n";
+        return "OK: " + daemon_id_list(manageable_by_user(user)) + "\n";
     }
 
     if (cmd == "status") {
-        string resp = strprintf("%-30s %-15s %9s %8s %8s %8s %8s\n", "daemon-id", "state", "pid", "respawns", "cooldown", "uptime", "total");
-        foreach(class daemon *d, manageable)
-          if (arg.empty() || arg == d->id)
-            resp += strprintf("%-30s %-15s %9d %8zd %8s %8s %8s\n",
-                              d->id.c_str(),
-                              d->state_str().c_str(),
-                              d->current.pid,
-                              d->current.respawns,
-                              elapsed(d->cooldown_remaining()).c_str(),
-                              elapsed(d->current.pid ? time(NULL) - d->current.respawn_time : 0).c_str(),
-                              elapsed(d->current.pid ? time(NULL) - d->current.start_time   : 0).c_str())
-                + d->get_and_clear_whines();
+        string resp = strprintf("%-30s %-15s %9s %8s %8s %8s %8s %6s %6s %5s %8s\n", "daemon-id", "state", "pid", "respawns", "cooldown", "uptime", "total",
+                                "cpu", "rss", "fds", "output");
+        if (arg.empty())
+            *more = status_rows(user);
+        else if (class daemon *d = find_manageable(user, arg))
+            resp += status_row(d);
         return "OK: " + resp;
     }
 
+    if (cmd == "status-json") {
+        *more = status_json_rows(user, parse_status_filter(arg));
+        return "OK: [\n";
+    }
+
+    if (cmd == "watch") {
+        if (!arg.empty() && !find_manageable(user, arg)) throw_str("unknown id \"%s\"", arg.c_str());
+        *more = subscribe(user, arg);
+        return "OK\n";
+    }
+
     if (cmd == "rescan") {
-        vector<class daemon*> new_daemons = load_daemons(user->manages, *daemons);
+        log_nss_cache_stats();
+        nss_cache_flush(); // Maybe they just added someone to a group or changed a home directory.
+        foreach(class user *u, user->manages) // In case their config directory has shown up since we last looked.
+            watcher->watch(u);
+        scan_stats scan;
+        vector<class daemon*> new_daemons = load_daemons(user->manages, &scan);
+        string cost = strprintf("Scanned %zd config files in %lldms (%zd new, %zd changed).\n", scan.files, (long long)scan.ms, scan.new_files, scan.changed);
         if (new_daemons.size() == 0)
-            return "OK: No new daemons found.\n";
-        daemons->insert(daemons->end(), new_daemons.begin(), new_daemons.end());
+            return "OK: No new daemons found.\n" + cost;
+        add_daemons(daemons, new_daemons);
         autostart(new_daemons);
         string fine_whines;
         foreach(class daemon *d, new_daemons)
             fine_whines += d->get_and_clear_whines();
-        return "OK: New daemons scanned: " + daemon_id_list(new_daemons) + "\n" + fine_whines;
+        return "OK: New daemons scanned: " + daemon_id_list(new_daemons) + "\n" + cost + fine_whines;
     }
 
     if (cmd == "export") {
         if (user->uid != 0) throw_str("Only root can export.");
-        char *buf;
-        size_t size;
-        FILE *f = open_memstream(&buf, &size);
-        export_daemons(*daemons, f);
-        fclose(f);
-        string resp = string("OK: ").append(buf, size);
-        free(buf);
-        return resp;
+        size_t i = 0;
+        *more = [daemons, i](string &out) mutable {
+            for (int n = 0; i < daemons->size() && n < 100; n++, i++)
+                out += (i ? ",\n" : "") + export_daemon((*daemons)[i]);
+            if (i < daemons->size())
+                return true;
+            out += export_footer;
+            return false;
+        };
+        return string("OK: ") + export_header;
     }
 
-    vector<class daemon*>::iterator d = find_if(manageable.begin(), manageable.end(), daemon_id_match(arg));
-    if (d == manageable.end()) throw_str("unknown id \"%s\"", arg.c_str());
-    class daemon *daemon = *d;
+    class daemon *daemon = find_manageable(user, arg);
+    if (!daemon) throw_str("unknown id \"%s\"", arg.c_str());
 
     if      (cmd == "start")   if (daemon->current.pid) throw_str("Already running \"%s\"", daemon->id.c_str());
                                else daemon->start();
     else if (cmd == "stop")    daemon->stop();
     else if (cmd == "restart") { daemon->stop(); daemon->start(); }
     else if (cmd == "logfile") return "OK: " + daemon->log_file();
+    else if (cmd == "lastlog") return "OK: " + daemon->lastlog();
     else if (cmd == "configfile") return "OK: " + daemon->config_file;
     else if (cmd == "pid")     if (!daemon->current.pid) throw_str("\"%s\" isn't running", daemon->id.c_str());
                                else return strprintf("OK: %d\n", daemon->current.pid);
@@ -713,6 +1506,12 @@ static string do_command(string command_line, user *user, vector<class daemon*>
   return "OK\n";
 }
 
+static void log_nss_cache_stats()
+{
+    struct nss_cache_stats s = nss_cache_stats();
+    log(LOG_INFO, "User/group lookups: %zd cached, %zd from NSS\n", s.hits, s.misses);
+}
+
 static void dump_config(struct master_config config)
 {
     log(LOG_DEBUG, "Config:\n");
@@ -761,7 +1560,13 @@ Once a daemon is running, 'daemon-manager' will respawn it if it ever
 quits. If the daemon is quitting and respawning too quickly then
 'daemon-manager' will start delaying before respawning it. This delay is
 called the cooldown time and is used to prevent heavy CPU usage when daemons
-with severe problems quit the instant they are started.
+with severe problems quit the instant they are started. It gets longer each
+time the daemon dies young, and varies a little so that daemons that died
+together don't all respawn together (see 'cooldown' in 'daemon.conf(5)').
+
+If 'daemon-manager' itself dies, the daemons keep running. The next
+'daemon-manager' takes them over instead of starting them again (see
+'state-journal' in 'daemon-manager.conf(5)').
 
 CREATING DAEMONS
 ----------------
@@ -772,6 +1577,10 @@ daemon you can issue the `'rescan'' command to 'dmctl(1)' which will cause
 'daemon-manager' to rescan all the daemon config directories looking for new
 .conf files.
 
+On Linux, 'daemon-manager' watches the daemon config directories with inotify
+and will load (and autostart) new .conf files as soon as they are written, so
+the `'rescan'' is usually unnecessary there.
+
 CONTROLLING DAEMONS
 -------------------
 To start, stop, and inspect daemons, use the 'dmctl(1)' program.
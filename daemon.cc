@@ -9,6 +9,9 @@
 #include "log.h"
 #include "posix-util.h"
 #include "foreach.h"
+#include "timers.h"
+#include "event-loop.h"
+#include "stringutil.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,21 +21,189 @@
 #include <fcntl.h>
 #include <algorithm>
 #include <stdexcept>
+#include <unordered_map>
+#include <deque>
+#include <random>
+#include <math.h>
 #include <libgen.h>
-#include <grp.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
-daemon::daemon(string config_file, class user *user)
-        : config_file(config_file), config_file_stamp(-1), user(user)
+daemon::daemon(string config_file, class user *user, int config_fd)
+        : config_file(config_file), config_file_stamp(-1), config_stale(true), user(user), cooldown_timer(0), cooldown_deadline(0), exec_status_fd(-1),
+          awaiting_spawner(false), collector(NULL), usage(), queued_respawn(false), adopted_pid(0), adopted_fd(-1), adopted_timer(0)
 {
-    current = (struct current) { 0,stopped,0,0,0,0,0 };
+    current = (struct current) { 0,0,stopped,0,0,0,0,0 };
+    launching = (struct launch) { false, -1, false, -1 };
     const char *stem = basename((char*)config_file.c_str());
     const char *ext = strstr(stem, ".conf");
     name = string(stem, ext ? (size_t)(ext - stem) : strlen(stem));
     id = user->name + "/" + name;
 
-    load_config();
+    if (config_fd >= 0)
+        load_config(config_fd);
+    else
+        load_config();
+}
+
+daemon::~daemon()
+{
+    set_pid(0);
+    timers.cancel(cooldown_timer);
+    close_exec_status();
+    forget_spawner();
+    dequeue();
+    delete collector;
+}
+
+std::function<void(class daemon *d, const char *event, int value)> state_change_hook;
+
+void daemon::changed(const char *event, int value)
+{
+    if (state_change_hook)
+        state_change_hook(this, event, value);
+}
+
+// Every daemon with a pid, so reaping doesn't have to search through all of them.
+static unordered_map<int, class daemon*> daemons_by_pid;
+
+class daemon *daemon_by_pid(int pid)
+{
+    auto d = daemons_by_pid.find(pid);
+    return d == daemons_by_pid.end() ? NULL : d->second;
+}
+
+static size_t default_lastlog_size;
+static struct cooldown_backoff default_backoff = { 10, 2, 60, 10, 60 };
+
+static size_t max_concurrent_spawns;
+static size_t spawns_in_flight;     // Daemons with an exec_status_fd or awaiting_spawner, ie, "starting".
+static map<pair<int,uint64_t>, class daemon*> spawn_queue;
+static uint64_t spawn_queue_serial; // So equal priorities go in the order they got in line.
+
+// For logging how long it takes to get everything up after a big batch of starts.
+static int64_t burst_start_ms = -1;
+static size_t burst_started, burst_failed; // burst_failed is a subset of burst_started
+
+// Daemons that asked the spawner to launch them, in the order they asked, which is the order the answers come
+// back in. NULL for one that stopped waiting (it was stopped, restarted or deleted in the meantime).
+static deque<class daemon*> spawner_askers;
+static timer_queue::timer_id spawner_timer;
+static const int64_t spawner_patience_ms = 5000; // It should answer in microseconds. If it doesn't, it's wedged.
+static unordered_map<int,int> early_exits;      // pid -> wait() status, for ones that died before we heard their pid.
+
+// It never got as far as having a pid.
+static void not_started(class daemon *d)
+{
+    d->current.state = stopped;
+    if (burst_start_ms >= 0)
+        burst_failed++;
+    if (state_change_hook)
+        state_change_hook(d, "exit", -1);
+}
+
+static void start_failed(class daemon *d, bool respawn, const char *why)
+{
+    log(LOG_ERR, "Couldn't %s %s: %s\n", respawn ? "respawn" : "start", d->id.c_str(), why);
+    not_started(d);
+}
+
+static void give_up_on_spawner()
+{
+    log(LOG_ERR, "Giving up on the spawner and launching daemons ourselves\n");
+    main_loop->remove_fd(spawner_fd());
+    stop_spawner();
+    timers.cancel(spawner_timer);
+    early_exits.clear();
+    deque<class daemon*> askers;
+    askers.swap(spawner_askers);
+    foreach(class daemon *d, askers)
+        if (d)
+            d->spawner_gave_up();
+}
+
+static void wait_for_spawner()
+{
+    timers.cancel(spawner_timer);
+    if (!spawner_askers.empty())
+        spawner_timer = timers.add_after(spawner_patience_ms, []() {
+            spawner_timer = 0;
+            log(LOG_ERR, "The spawner hasn't answered in %llds\n", (long long)spawner_patience_ms / 1000);
+            give_up_on_spawner();
+        });
+}
+
+static void listen_to_spawner()
+{
+    spawner_answer answer;
+    int heard;
+    while ((heard = hear_from_spawner(&answer)) > 0) {
+        class daemon *d = NULL;
+        if (spawner_askers.empty())
+            log(LOG_ERR, "The spawner answered a question nobody asked (pid %d)\n", answer.pid);
+        else {
+            d = spawner_askers.front();
+            spawner_askers.pop_front();
+            wait_for_spawner(); // For the next one.
+        }
+        if (d)
+            d->spawner_answered(answer);
+        else if (answer.pid) { // Nobody wants it any more (it was stopped or deleted while we waited to hear).
+            if (!early_exits.erase(answer.pid)) // Careful--if it's already been reaped, the pid could be anybody's now.
+                kill(answer.pid, SIGTERM);
+            close(answer.exec_status_fd);
+        }
+    }
+    if (heard < 0)
+        give_up_on_spawner();
+    if (spawner_askers.empty())
+        early_exits.clear();
+}
+
+static void asked_spawner(class daemon *d)
+{
+    if (!main_loop->watching(spawner_fd()))
+        main_loop->add_fd(spawner_fd(), event_loop::ev_read, [](int, int) { listen_to_spawner(); });
+    spawner_askers.push_back(d);
+    if (spawner_askers.size() == 1)
+        wait_for_spawner();
+}
+
+void unclaimed_child_exited(int pid, int status)
+{
+    if (!spawner_askers.empty())
+        early_exits[pid] = status;
+}
+
+void finish_spawner_requests()
+{
+    int64_t deadline = monotonic_ms() + 1000;
+    while (!spawner_askers.empty() && spawner_fd() >= 0) {
+        struct pollfd p = { spawner_fd(), POLLIN, 0 };
+        int64_t left = deadline - monotonic_ms();
+        if (left <= 0 || poll(&p, 1, left) <= 0)
+            break;
+        listen_to_spawner();
+    }
+    if (!spawner_askers.empty())
+        give_up_on_spawner();
+}
+
+void daemon::set_pid(int pid)
+{
+    if (adopted_pid && pid != adopted_pid)
+        unwatch_adopted();
+    if (pid != current.pid)
+        usage = proc_usage();
+    if (current.pid && daemon_by_pid(current.pid) == this)
+        daemons_by_pid.erase(current.pid);
+    current.pid = pid;
+    if (pid)
+        daemons_by_pid[pid] = this;
 }
 
 string daemon::get_and_clear_whines()
@@ -48,27 +219,102 @@ string daemon::get_and_clear_whines()
 
 void daemon::load_config()
 {
-    struct stat st = permissions::check(config_file, 0113, user->uid);
-    if (st.st_mtime == config_file_stamp) return;
+    int fd = open(config_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw_str("%s doesn't exist", config_file.c_str());
+    try { load_config(fd); }
+    catch (...) { close(fd); throw; }
+    close(fd);
+}
 
-    struct daemon_config config_in = parse_daemon_config(config_file);
+void daemon::load_config(int fd)
+{
+    struct stat st = permissions::check(fd, config_file, 0113, user->uid);
+    if (st.st_mtime == config_file_stamp) {
+        config_stale = false;
+        return;
+    }
+
+    struct daemon_config config_in = parse_daemon_config(fd, config_file);
     map<string,string> cfg = config_in.config;
     config.environment = config_in.env;
 
     // Look up all the keys and warn if we don't recognize them. Helps find typos in .conf files.
-    whine_list = validate_keys(cfg, config_file, { "dir", "user", "start", "autostart", "output", "shell" });
+    whine_list = validate_keys(cfg, config_file, { "dir", "user", "start", "autostart", "output", "shell", "exec", "priority",
+                                                     "log-max-size", "log-max-age", "log-keep", "lastlog-size",
+                                                     "cooldown", "cooldown-factor", "cooldown-max", "cooldown-jitter", "cooldown-reset" });
 
     config.working_dir = cfg.count("dir") ? cfg["dir"] : "/";
     pwent pw = pwent(cfg.count("user") ? cfg["user"] : user->name);
     if (!pw.valid) throw_str("%s is not allowed to run as unknown user %s in %s\n", user->name.c_str(), cfg["user"].c_str(), config_file.c_str());
     if (!user->can_run_as_uid.count(pw.uid)) throw_str("%s is not allowed to run as %s[%u] in %s\n", user->name.c_str(), cfg["user"].c_str(), pw.uid, config_file.c_str());
     config.run_as = pw;
-    if (!cfg.count("start")) throw_str("Missing \"start\" in %s\n", config_file.c_str());
-    config.start_command = cfg["start"];
+    if (!cfg.count("start") && !cfg.count("exec")) throw_str("Missing \"start\" or \"exec\" in %s\n", config_file.c_str());
+    if (cfg.count("start") && cfg.count("exec")) throw_str("Only one of \"start\" and \"exec\" is allowed in %s\n", config_file.c_str());
+    config.direct_exec = cfg.count("exec");
+    config.start_command = config.direct_exec ? cfg["exec"] : cfg["start"];
+    config.shell = cfg.count("shell") ? cfg["shell"] : "/bin/sh";
+    if (config.direct_exec && cfg.count("shell"))
+        whine_list.push_back(strprintf("\"shell\" doesn't do anything without \"start\" in %s\n", config_file.c_str()));
     config.autostart = !cfg.count("autostart") || strchr("YyTt1Oo", cfg["autostart"].c_str()[0]);
     config.log_output = cfg.count("output") && cfg["output"] == "log";
+    config.collect_output = cfg.count("output") && cfg["output"] == "collect";
+    config.log_limits = (struct log_collector::limits) { 0, 0, 5 };
+    try {
+        config.log_limits.max_size = size_setting(cfg, "log-max-size", 0);
+        config.log_limits.max_age  = duration_setting(cfg, "log-max-age", 0);
+        config.log_limits.keep     = long_setting(cfg, "log-keep", 5);
+    } catch (std::exception &e) { whine_list.push_back(strprintf("%s in %s\n", e.what(), config_file.c_str())); }
+    if (!config.collect_output && (cfg.count("log-max-size") || cfg.count("log-max-age") || cfg.count("log-keep")))
+        whine_list.push_back(strprintf("log-max-size, log-max-age and log-keep only work with \"output=collect\" in %s\n", config_file.c_str()));
+    config.lastlog_size = default_lastlog_size;
+    try { config.lastlog_size = size_setting(cfg, "lastlog-size", default_lastlog_size); }
+    catch (std::exception &e) { whine_list.push_back(strprintf("%s in %s\n", e.what(), config_file.c_str())); }
+    if (config.log_output && cfg.count("lastlog-size"))
+        whine_list.push_back(strprintf("\"lastlog-size\" doesn't do anything with \"output=log\" (look in the log) in %s\n", config_file.c_str()));
+    config.backoff = default_backoff;
+    try { config.backoff = backoff_settings(cfg); }
+    catch (std::exception &e) { whine_list.push_back(strprintf("%s in %s\n", e.what(), config_file.c_str())); }
+    config.priority = 0;
+    if (cfg.count("priority"))
+        try { config.priority = long_setting(cfg, "priority", 0); }
+        catch (std::exception &e) { whine_list.push_back(strprintf("%s in %s\n", e.what(), config_file.c_str())); }
+
+    map<string,string> env = config.environment, defaults = { {"HOME",    config.run_as.dir  },
+                                                              {"LOGNAME", config.run_as.name },
+                                                              {"PATH",    "/usr/bin:/bin",   } };
+    env.insert(defaults.begin(), defaults.end());
+    plan.env.clear();
+    foreach(const auto &e, env)
+        plan.env.push_back(e.first + "=" + e.second);
+    config.search_path = env["PATH"];
+    if (config.direct_exec) {
+        plan.argv.clear();
+        if (!split_words(plan.argv, config.start_command)) throw_str("Unmatched quote in \"exec\" in %s\n", config_file.c_str());
+        if (plan.argv.empty())                            throw_str("Nothing to run in \"exec\" in %s\n", config_file.c_str());
+        plan.path = exec_path(plan.argv[0]);
+        if (plan.path.empty()) // Not fatal--it might get installed later. start() will look again.
+            whine_list.push_back(strprintf("Couldn't find \"%s\" in %s (from %s)\n", plan.argv[0].c_str(), config.search_path.c_str(), config_file.c_str()));
+    } else {
+        plan.path = config.shell;
+        plan.argv = { config.shell, "-c", config.start_command };
+    }
+    plan.uid = config.run_as.uid;
+    plan.gid = config.run_as.gid;
+    plan.dir = config.working_dir;
+    plan.seal();
 
     config_file_stamp = st.st_mtime;
+    config_stale = false;
+}
+
+// Done once, when the config is loaded, instead of having execvp() search every time we launch.
+string daemon::exec_path(string program)
+{
+    if (program.find('/') == string::npos)
+        return find_in_path(program, config.search_path);
+    if (program[0] == '/')
+        return program;
+    return config.working_dir + "/" + program;
 }
 
 bool daemon::exists()
@@ -82,149 +328,440 @@ string daemon::log_file()
     return user->log_dir() + "/" + name + ".log";
 }
 
-#include <pwd.h>
-// Just like initgroups() but actually check for errors ಠ_ಠ
-int _initgroups(const char *user, gid_t user_gid)
+string daemon::lastlog()
 {
-    if (!user || !*user) throw_str("Bad username"); // getpwnam() returns something for ""!!
-    struct passwd *pw = getpwnam(user);
-    if (!pw) throw_str("User %s not found", user);
-
-    return initgroups(user, user_gid);
+    if (!collector || !collector->ring)
+        throw_str("\"%s\" doesn't keep a lastlog (see \"lastlog-size\" in daemon.conf(5))", id.c_str());
+    collector->drain(); // Catch up first--it might have just said something.
+    string out = collector->ring->contents();
+    out.erase(remove(out.begin(), out.end(), '\0'), out.end()); // Responses end with a NUL.
+    return out;
 }
 
+// By the time anything can throw, it's already out of the queue, off its cooldown timer and forgotten by
+// the spawner, so a throw has to leave it stopped or nothing would ever start it again.
 void daemon::start(bool respawn)
+{
+    try { launch(respawn); }
+    catch (...) {
+        not_started(this);
+        throw; // For the caller to report.
+    }
+}
+
+void daemon::launch(bool respawn)
 {
     log(LOG_INFO, "Starting %s\n", id.c_str());
+    timers.cancel(cooldown_timer);
+    dequeue(); // Somebody got impatient.
+
+    if (config_stale || !user->config_watched)
+        load_config(); // Make sure we are up to date.
 
-    load_config(); // Make sure we are up to date.
+    close_exec_status(); // A restart before the last start finished,
+    forget_spawner();    // or before the spawner even got back to us.
+    if (plan.path.empty() && (plan.path = exec_path(plan.argv[0])).empty())
+        throw_str("Couldn't find \"%s\" in %s", plan.argv[0].c_str(), config.search_path.c_str());
+    log(LOG_INFO, "Launching %s\n", config.start_command.c_str());
+    plan.groups = supplementary_groups(config.run_as.name, config.run_as.gid); // Cached, so cheap.
+    size_t ring_size = config.log_output ? 0 : config.lastlog_size; // output=log has its own file, so no ring there.
+    if (!config.collect_output && !ring_size) {
+        delete collector; // They changed their config.
+        collector = NULL;
+    } else {
+        string path = config.collect_output ? log_file() : "";
+        if (!collector)
+            collector = new log_collector(path, user->uid, user->gid);
+        collector->set_path(path);
+        collector->set_ring_size(ring_size);
+        collector->limits = config.log_limits;
+    }
+    launching.respawn = respawn;
+    launching.banner_at = -1;
+    launching.out_fd = collector ? collector->output_fd() : config.log_output ? open_log(&launching.banner_at) : -1;
+    launching.own_out_fd = !collector && launching.out_fd >= 0;
+    if (collector)
+        launching.banner_at = collector->append(log_banner());
 
-    current.pid = fork_setuid_exec(config.start_command, config.environment);
+    int pid, status_fd;
+    try {
+        // The spawner answers later (see listen_to_spawner()), so we don't sit here waiting on it.
+        int asked = spawner_fd() < 0 ? 0 : ask_spawner(plan, launching.out_fd);
+        if (asked < 0)
+            give_up_on_spawner();
+        if (asked > 0) {
+            awaiting_spawner = true;
+            spawns_in_flight++;
+            current.state = starting;
+            asked_spawner(this);
+            return;
+        }
+        pid = plan.spawn(launching.out_fd, &status_fd);
+    } catch (...) { close_launch_fd(); throw; }
+    launched(pid, status_fd);
+}
+
+void daemon::launched(int pid, int status_fd)
+{
+    if (collector)
+        collector->note_start(launching.banner_at, pid);
+    else if (launching.own_out_fd)
+        index_start(launching.out_fd, launching.banner_at, pid);
+    close_launch_fd();
+    set_pid(pid);
+    current.pid_start = process_start_time(pid);
     log(LOG_INFO, "Started %s (running as %s). pid=%d\n", id.c_str(), config.run_as.name.c_str(), current.pid);
     current.respawn_time = time(NULL);
-    if (respawn)
+    if (launching.respawn)
         current.respawns++;
     else
         current.start_time = time(NULL);
-    current.state = running;
-}
-
-int daemon::fork_setuid_exec(string command, map<string,string> env_in)
-{
-    log(LOG_INFO, "Launching %s\n", command.c_str());
-
-    int fd[2];
-    if (pipe(fd) <0) throw_strerr("Couldn't pipe");
-    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
-    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
-    int child = fork();
-    if (child == -1) throw_strerr("Fork failed\n");
-    if (child) {
-        // Parent
-        close(fd[1]);
-        char err[1000]="";
-        int red = read(fd[0], &err, sizeof(err)-1);
-        close(fd[0]);
-        if(red > 0) {
-            this->reap();
-            throw runtime_error(string(err));
-        }
-        return child;
+    current.state = starting;
+    exec_status_fd = status_fd;
+    spawns_in_flight++;
+    changed(launching.respawn ? "respawn" : "start");
+    main_loop->add_fd(exec_status_fd, event_loop::ev_read, [this](int, int) { check_exec_status(); });
+}
+
+void daemon::close_launch_fd()
+{
+    if (launching.own_out_fd)
+        close(launching.out_fd);
+    launching.out_fd = -1;
+    launching.own_out_fd = false;
+}
+
+void daemon::spawner_answered(const spawner_answer &answer)
+{
+    awaiting_spawner = false;
+    spawns_in_flight--;
+    if (!answer.pid) {
+        close_launch_fd();
+        start_failed(this, launching.respawn, answer.error.c_str());
+        return;
+    }
+    launched(answer.pid, answer.exec_status_fd);
+    auto early = early_exits.find(answer.pid);
+    if (early != early_exits.end()) { // It didn't wait for us to hear about it.
+        int status = early->second;
+        early_exits.erase(early);
+        try { exited(status); }
+        catch(std::exception &e) { log(LOG_ERR, "Couldn't respawn %s: %s\n", id.c_str(), e.what()); }
     }
+}
 
-    // Child
-    try {
-        close(fd[0]);
-        if (config.log_output) {
-            close(1);
-            close(2);
-            string logfile = log_file();
-            open(logfile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0750) ==  1 || throw_strerr("Couldn't open log file %s", logfile.c_str());
-            dup2(1,2)                                                  == -1 && throw_strerr("Couldn't dup stdout to stderr");
-            chown(logfile.c_str(), user->uid, user->gid)               == -1 && throw_strerr("Couldn't change %s to uid %d gid %d", logfile.c_str(), user->uid, user->gid);
-            time_t t = time(NULL);
-            const char *dashes="----------------------------------------------------------------------------------------------------";
-            string as = user->uid == config.run_as.uid ? "" : strprintf(" (as %s)", config.run_as.name.c_str());
-            int dash_length = (int)id.size() + (int)as.size() + 24+9+2+2+4;
-            fprintf(stderr,
-                    "\n+%.*s+\n"
-                    "| %.24s Starting \"%s\"%s... |\n"
-                    "+%.*s+\n"
-                    "> %s\n", dash_length, dashes,
-                    ctime(&t), id.c_str(), as.c_str(),
-                    dash_length, dashes,
-                    command.c_str());
-        }
-        _initgroups(config.run_as.name.c_str(), config.run_as.gid)
-                                          == -1 && throw_strerr("Couldn't init groups for %s", config.run_as.name.c_str());
-        setgid(config.run_as.gid)         == -1 && throw_strerr("Couldn't set gid to %d\n", config.run_as.gid);
-        setuid(config.run_as.uid)         == -1 && throw_strerr("Couldn't set uid to %d (%s)", config.run_as.uid, user->name.c_str());
-        chdir(config.working_dir.c_str()) == -1 && throw_strerr("Couldn't change to directory %s", config.working_dir.c_str());
-
-        map<string,string> ENV = env_in, defaults =  { {"HOME",    config.run_as.dir  },
-                                                       {"LOGNAME", config.run_as.name },
-                                                       {"PATH",    "/usr/bin:/bin",   } };
-        ENV.insert(defaults.begin(), defaults.end());
-        list<string> envs;                         // Storage for the full env c++ strings.
-        const char *env[ENV.size()+1], **e = env;  // c-string pointers into envs[]
-        typedef pair<string,string> pss;
-        foreach(pss ep, ENV) {
-            envs.push_front(ep.first + "=" + ep.second);
-            *e++ = envs.front().c_str();
-        }
-        *e = NULL;
-        execle("/bin/sh", "/bin/sh", "-c", command.c_str(), (char*)NULL, env);
-        throw_strerr("Couldn't exec");
-    } catch (std::exception &e) {
-        write(fd[1], e.what(), strlen(e.what())+1/*NULL*/);
-        close(fd[1]);
-        exit(0);
+void daemon::spawner_gave_up()
+{
+    awaiting_spawner = false;
+    spawns_in_flight--;
+    int pid, status_fd;
+    try { pid = plan.spawn(launching.out_fd, &status_fd); }
+    catch(std::exception &e) {
+        close_launch_fd();
+        start_failed(this, launching.respawn, e.what());
+        return;
     }
-    return -1; // Can't happen--just here to shut gcc up.
+    launched(pid, status_fd);
+}
+
+// Its answer still comes, but it goes to nobody (and whatever it launched gets killed).
+void daemon::forget_spawner()
+{
+    if (!awaiting_spawner) return;
+    replace(spawner_askers.begin(), spawner_askers.end(), this, (class daemon*)NULL);
+    awaiting_spawner = false;
+    spawns_in_flight--;
+    close_launch_fd();
+}
+
+// The child writes why it couldn't exec down the pipe. If it did exec, the pipe just closes (it's CLOEXEC).
+// Either way we don't sit around waiting--there might be a lot of other daemons starting up.
+void daemon::check_exec_status()
+{
+    exec_plan::exec_failure failure;
+    ssize_t red = read(exec_status_fd, &failure, sizeof(failure));
+    if (red < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    close_exec_status();
+    if (red == sizeof(failure)) {
+        string err = plan.describe(failure);
+        log(LOG_ERR, "Couldn't start %s: %s\n", id.c_str(), err.c_str());
+        if (burst_start_ms >= 0)
+            burst_failed++;
+        whine_list.push_back(strprintf("Couldn't start %s: %s\n", id.c_str(), err.c_str()));
+        return; // The child exits and gets reaped like any other.
+    }
+    if (current.state == starting) {
+        current.state = running;
+        changed("running");
+    }
+}
+
+string daemon::log_banner()
+{
+    time_t t = time(NULL);
+    const char *dashes="----------------------------------------------------------------------------------------------------";
+    string as = user->uid == config.run_as.uid ? "" : strprintf(" (as %s)", config.run_as.name.c_str());
+    int dash_length = (int)id.size() + (int)as.size() + 24+9+2+2+4;
+    return strprintf("\n+%.*s+\n"
+                     "| %.24s Starting \"%s\"%s... |\n"
+                     "+%.*s+\n"
+                     "> %s\n", dash_length, dashes,
+                     ctime(&t), id.c_str(), as.c_str(),
+                     dash_length, dashes,
+                     config.start_command.c_str());
+}
+
+// Opened by us rather than the child so the child has nothing to do but exec.
+int daemon::open_log(off_t *banner_at)
+{
+    string logfile = log_file();
+    int fd = open(logfile.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0750);
+    if (fd < 0) throw_strerr("Couldn't open log file %s", logfile.c_str());
+    if (fchown(fd, user->uid, user->gid) < 0) {
+        close(fd);
+        throw_strerr("Couldn't change %s to uid %d gid %d", logfile.c_str(), user->uid, user->gid);
+    }
+    *banner_at = lseek(fd, 0, SEEK_END); // Where O_APPEND is about to put it.
+    string banner = log_banner();
+    write(fd, banner.data(), banner.size());
+    return fd;
+}
+
+// With "output=log" the daemon writes its log itself, so all we can index is where each run starts.
+void daemon::index_start(int log_fd, off_t banner_at, int pid)
+{
+    log_index index(log_file());
+    try {
+        index.open_for_append(log_fd, user->uid, user->gid);
+        index.add(log_index::start, banner_at, pid);
+    } catch (std::exception &e) { log(LOG_WARNING, "%s (%s won't be indexed)\n", e.what(), log_file().c_str()); }
 }
 
 void daemon::stop()
 {
+    if (awaiting_spawner) {
+        forget_spawner();
+        current.state = stopped;
+        changed("stop");
+    }
+    if (current.state == queued) {
+        dequeue();
+        current.state = stopped;
+        changed("stop");
+    }
     if (current.pid) {
         log(LOG_INFO, "Stopping [%d] %s\n", current.pid, id.c_str());
         kill(current.pid, SIGTERM);
         current.state = stopping;
+        changed("stop");
     }
-    if (current.state == coolingdown)
+    if (current.state == coolingdown) {
+        timers.cancel(cooldown_timer);
         current.state = stopped;
+        changed("stop");
+    }
     current.respawns = 0;
 }
 
 
-void daemon::respawn()
+void daemon::close_exec_status()
+{
+    if (exec_status_fd < 0) return;
+    spawns_in_flight--;
+    main_loop->remove_fd(exec_status_fd);
+    close(exec_status_fd);
+    exec_status_fd = -1;
+}
+
+void daemon::exited(int status)
+{
+    if (exec_status_fd >= 0)
+        check_exec_status(); // It's dead, so whatever it had to say is already in the pipe.
+    if (current.state == running)
+        respawn(status);
+    else
+        reap(status);
+}
+
+// It was started by an earlier us that died without handing it over (see state_journal), so it's not our
+// child and we'll never wait() for it. A pidfd (or, without those, checking every second) tells us when
+// it's gone instead. Its output went to that earlier us if it wasn't going to a log file, so that's lost.
+void daemon::adopt(int pid, uint64_t pid_start, time_t started, bool was_stopping)
+{
+    set_pid(pid);
+    current.pid_start = pid_start;
+    current.state = was_stopping ? stopping : running;
+    current.start_time = current.respawn_time = started;
+    adopted_pid = pid;
+    watch_adopted();
+}
+
+void daemon::watch_adopted()
+{
+#ifdef SYS_pidfd_open
+    adopted_fd = syscall(SYS_pidfd_open, adopted_pid, 0); // Already close-on-exec.
+    if (adopted_fd >= 0) {
+        main_loop->add_fd(adopted_fd, event_loop::ev_read, [this](int, int) { adopted_exited(); });
+        return;
+    }
+#endif
+    check_adopted();
+}
+
+void daemon::check_adopted()
+{
+    adopted_timer = 0;
+    if (kill(adopted_pid, 0) < 0 && errno == ESRCH || process_start_time(adopted_pid) != current.pid_start)
+        return adopted_exited();
+    adopted_timer = timers.add(monotonic_ms() + 1000, [this]() { check_adopted(); });
+}
+
+void daemon::unwatch_adopted()
+{
+    if (adopted_fd >= 0) {
+        main_loop->remove_fd(adopted_fd);
+        close(adopted_fd);
+    }
+    timers.cancel(adopted_timer);
+    adopted_fd = -1;
+    adopted_timer = 0;
+    adopted_pid = 0;
+}
+
+void daemon::adopted_exited()
+{
+    int pid = adopted_pid;
+    unwatch_adopted();
+    if (current.pid != pid) return;
+    log(LOG_NOTICE, "Adopted %s [%d] exited\n", id.c_str(), pid);
+    try { exited(-1); } // No idea how it went.
+    catch(std::exception &e) { log(LOG_ERR, "Couldn't respawn %s: %s\n", id.c_str(), e.what()); }
+}
+
+// Up to percent either way.
+static int64_t jittered(int64_t ms, int percent)
+{
+    static std::mt19937 rng((std::random_device())());
+    if (!percent) return ms;
+    std::uniform_int_distribution<int64_t> spread(-ms * percent / 100, ms * percent / 100);
+    return max((int64_t)0, ms + spread(rng));
+}
+
+void daemon::respawn(int status)
 {
-    reap();
+    reap(status);
     time_t now = time(NULL);
     time_t uptime = now - current.respawn_time;
-    if (uptime < 60) current.cooldown = min((time_t)60, current.cooldown + 10); // back off if it's dying too often
-    if (uptime > 60) current.cooldown = 0; // Clear cooldown on good behavior
+    const struct cooldown_backoff &b = config.backoff;
+    if (uptime < b.reset) // back off if it's dying too often
+        current.cooldown = current.cooldown ? (time_t)min((double)b.max, ceil(current.cooldown * b.factor)) // In double, so a big factor can't overflow.
+                                            : min(b.max, b.first);
+    else
+        current.cooldown = 0; // Clear cooldown on good behavior
     if (current.cooldown) {
-        log(LOG_NOTICE, "%s is respawning too quickly, backing off. Cooldown time is %d seconds\n", id.c_str(), (int)current.cooldown);
+        int64_t delay = jittered(current.cooldown * 1000, b.jitter);
+        log(LOG_NOTICE, "%s is respawning too quickly, backing off. Cooldown time is %.1f seconds\n", id.c_str(), delay / 1000.0);
         current.cooldown_start = now;
         current.state = coolingdown;
+        schedule_cooldown(monotonic_ms() + delay);
+        changed("cooldown", (delay + 999) / 1000);
     } else
         start(true);
 }
 
-void daemon::reap()
+void daemon::reap(int status)
 {
-    current.pid = 0;
     current.state = stopped;
+    changed("exit", status); // Before clearing the pid so the subscribers can see which process it was.
+    set_pid(0);
+}
+
+void daemon::schedule_cooldown(int64_t deadline)
+{
+    timers.cancel(cooldown_timer);
+    cooldown_deadline = deadline;
+    cooldown_timer = timers.add(cooldown_deadline, [this]() { cooldown_timer = 0; cooldown_expired(); });
 }
 
 time_t daemon::cooldown_remaining()
 {
-    return max((time_t)0, current.cooldown - (time(NULL) - current.cooldown_start));
+    if (current.state != coolingdown) return 0;
+    return max((int64_t)0, (cooldown_deadline - monotonic_ms() + 999) / 1000);
+}
+
+void daemon::cooldown_expired()
+{
+    log(LOG_INFO, "Cooldown time has arrived for %s\n", id.c_str());
+    changed("cooldown-over");
+    queue_start(true);
 }
 
-bool daemon_compare(class daemon *a, class daemon *b)
+void set_max_concurrent_spawns(size_t max)
 {
-    return a->config_file < b->config_file;
+    max_concurrent_spawns = max;
+}
+
+void set_default_lastlog_size(size_t size)
+{
+    default_lastlog_size = size;
+}
+
+struct cooldown_backoff backoff_settings(map<string,string> settings)
+{
+    struct cooldown_backoff b = default_backoff;
+    b.first  = duration_setting(settings, "cooldown",        b.first);
+    b.factor = number_setting(settings,   "cooldown-factor", b.factor);
+    b.max    = duration_setting(settings, "cooldown-max",    b.max);
+    b.jitter = percent_setting(settings,  "cooldown-jitter", b.jitter);
+    b.reset  = duration_setting(settings, "cooldown-reset",  b.reset);
+    if (b.factor < 1)   throw_str("cooldown-factor can't be less than 1");
+    if (b.jitter > 100) throw_str("cooldown-jitter can't be more than 100%%");
+    return b;
+}
+
+void set_default_backoff(struct cooldown_backoff backoff)
+{
+    default_backoff = backoff;
+}
+
+void daemon::queue_start(bool respawn)
+{
+    if (current.state == queued) return;
+    if (burst_start_ms < 0)
+        burst_start_ms = monotonic_ms();
+    spawn_queue_key = make_pair(-config.priority, spawn_queue_serial++);
+    spawn_queue[spawn_queue_key] = this;
+    queued_respawn = respawn;
+    current.state = queued;
+    changed("queued");
+}
+
+void daemon::dequeue()
+{
+    if (current.state == queued)
+        spawn_queue.erase(spawn_queue_key);
+}
+
+void start_queued_daemons()
+{
+    while (!spawn_queue.empty() && (!max_concurrent_spawns || spawns_in_flight < max_concurrent_spawns)) {
+        class daemon *d = spawn_queue.begin()->second;
+        burst_started++;
+        try {
+            d->start(d->queued_respawn);
+        } catch(std::exception &e) {
+            log(LOG_ERR, "Couldn't %s %s: %s\n", d->queued_respawn ? "respawn" : "start", d->id.c_str(), e.what());
+        }
+    }
+
+    if (burst_start_ms >= 0 && spawn_queue.empty() && !spawns_in_flight) {
+        if (burst_started + burst_failed > 1)
+            log(LOG_NOTICE, "Started %zd daemons in %lldms (%zd failed to start)\n", burst_started,
+                (long long)(monotonic_ms() - burst_start_ms), burst_failed);
+        burst_start_ms = -1;
+        burst_started = burst_failed = 0;
+    }
 }
 
 map<string,string> daemon::to_map()
@@ -235,12 +772,25 @@ map<string,string> daemon::to_map()
     data["config_file"]            = config_file;
     data["user"]                   = user->name;
     data["current.pid"]            = strprintf("%d", current.pid);
+    data["current.pid_start"]      = strprintf("%llu", (unsigned long long)current.pid_start);
+    if (adopted_pid)
+        data["current.adopted"]    = "1";
+    if (current.state == coolingdown) // The monotonic clock is the same one after an exec.
+        data["cooldown_deadline"]  = strprintf("%lld", (long long)cooldown_deadline);
     data["current.state"]          = _state_str[current.state];
     data["current.cooldown"]       = strprintf("%lld", (long long)current.cooldown);
     data["current.cooldown_start"] = strprintf("%lld", (long long)current.cooldown_start);
     data["current.respawns"]       = strprintf("%zd", current.respawns);
     data["current.start_time"]     = strprintf("%lld", (long long)current.start_time);
     data["current.respawn_time"]   = strprintf("%lld", (long long)current.respawn_time);
+    if (collector) { // So a re-exec()ed us can pick up where we left off. See reincarnate().
+        data["log.read_fd"]        = strprintf("%d", collector->read_fd);
+        data["log.write_fd"]       = strprintf("%d", collector->write_fd);
+        data["log.opened"]         = strprintf("%lld", (long long)collector->opened);
+        data["log.bytes"]          = strprintf("%llu", (unsigned long long)collector->bytes_total);
+        if (collector->ring && collector->ring->fd >= 0)
+            data["log.ring_fd"]    = strprintf("%d", collector->ring->fd);
+    }
     return data;
 }
 
@@ -260,10 +810,43 @@ void daemon::from_map(map<string,string> data)
     throw_str("current.state \"%s\" is invalid!", data["current.state"].c_str());
   found:
 
-    current.pid            = strtoul(data["current.pid"].c_str(), NULL, 10);
+    set_pid(strtoul(data["current.pid"].c_str(), NULL, 10));
+    current.pid_start      = data.count("current.pid_start") ? strtoull(data["current.pid_start"].c_str(), NULL, 10)
+                                                             : current.pid ? process_start_time(current.pid) : 0; // From an older us.
     current.cooldown       = strtoull(data["current.cooldown"].c_str(), NULL, 10);
     current.cooldown_start = strtoull(data["current.cooldown_start"].c_str(), NULL, 10);
     current.respawns       = strtoul(data["current.respawns"].c_str(), NULL, 10);
     current.start_time     = strtoull(data["current.start_time"].c_str(), NULL, 10);
     current.respawn_time   = strtoull(data["current.respawn_time"].c_str(), NULL, 10);
+
+    if (data.count("log.read_fd")) {
+        collector = new log_collector(config.collect_output ? log_file() : "", user->uid, user->gid, atoi(data["log.read_fd"].c_str()),
+                                      atoi(data["log.write_fd"].c_str()), strtoll(data["log.opened"].c_str(), NULL, 10));
+        collector->limits = config.log_limits;
+        collector->bytes_total = strtoull(data["log.bytes"].c_str(), NULL, 10);
+        if (data.count("log.ring_fd"))
+            collector->ring = new output_ring(atoi(data["log.ring_fd"].c_str()));
+    }
+
+    if (data.count("current.adopted") && current.pid) {
+        adopted_pid = current.pid;
+        watch_adopted();
+    }
+
+    // Whatever was starting either made it or didn't, but the pipe that would have told us is gone. Without a
+    // pid it was still waiting on the spawner, so it never did start.
+    if (current.state == starting)
+        current.state = current.pid ? running : queued;
+    // The queue didn't come with us, so get back in line. Whether it was a respawn is a guess, but that only
+    // matters for the log message.
+    if (current.state == queued) {
+        current.state = stopped;
+        queue_start(current.respawns > 0);
+    }
+
+    // The old process's timers didn't survive the exec. An older us didn't pass along the deadline, so figure out
+    // how much cooldown is left from the wall clock.
+    if (current.state == coolingdown)
+        schedule_cooldown(data.count("cooldown_deadline") ? strtoll(data["cooldown_deadline"].c_str(), NULL, 10)
+                          : monotonic_ms() + max((time_t)0, current.cooldown - (time(NULL) - current.cooldown_start)) * 1000);
 }
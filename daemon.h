@@ -5,21 +5,40 @@
 
 #include "user.h"
 #include "passwd.h"
+#include "timers.h"
+#include "spawn.h"
+#include "log-collector.h"
+#include "proc-stats.h"
 #include <string>
 #include <list>
+#include <functional>
 #include <time.h>
+#include <stdint.h>
 
-enum run_state { stopped, stopping, running, coolingdown };
-const std::string _state_str[] = { "stopped", "stopping", "running", "coolingdown" };
+enum run_state { stopped, stopping, running, coolingdown, starting, queued };
+const std::string _state_str[] = { "stopped", "stopping", "running", "coolingdown", "starting", "queued" };
 
 const map<string,string> the_empty_map;
 
+// How long to wait before respawning a daemon that keeps dying. Each time it dies less than reset seconds after
+// starting, it waits factor times longer than the last time (starting at first, up to max), give or take up to
+// jitter percent so that a pile of daemons that died together (because something they all use went away) don't
+// all come back together.
+struct cooldown_backoff {
+    time_t first;  // "cooldown"
+    double factor; // "cooldown-factor"
+    time_t max;    // "cooldown-max"
+    int jitter;    // "cooldown-jitter"
+    time_t reset;  // "cooldown-reset"
+};
+
 class daemon {
   public:
     std::string id;
     std::string name;
     std::string config_file;
     time_t config_file_stamp;
+    bool config_stale; // config_file has changed since load_config() (only tracked when user->config_watched)
     //int socket;
     class user *user;
 
@@ -27,47 +46,126 @@ class daemon {
     struct config {
         std::string working_dir;
         pwent run_as;
-        std::string start_command;
+        std::string start_command; // The "start" line, or the "exec" line if direct_exec.
+        bool direct_exec;          // "exec": run it ourselves instead of handing it to the shell.
+        std::string shell;
+        std::string search_path;   // $PATH, for finding the "exec" program.
         bool autostart;
         bool log_output;
+        bool collect_output;       // "output=collect": we write the log, through log_collector.
+        struct log_collector::limits log_limits;
+        size_t lastlog_size;       // Bytes of output to keep in memory for "lastlog". 0 for none.
+        struct cooldown_backoff backoff;
+        int priority; // Higher goes first when there's a line to get started.
         std::map<std::string,std::string> environment;
     } config;
+    exec_plan plan; // config, ready to launch
 
     // state:
     struct current {
         int pid;
+        uint64_t pid_start; // process_start_time(pid), so the state journal can tell it from a reused pid.
         run_state state;
-        time_t cooldown;
+        time_t cooldown;           // Before the jitter. The next one is based on it.
         time_t cooldown_start;
         size_t respawns;
         time_t start_time;
         time_t respawn_time;
     } current;
+    timer_queue::timer_id cooldown_timer;
+    int64_t cooldown_deadline; // monotonic_ms()
+    int exec_status_fd;        // While starting: the child tells us here if it couldn't exec.
+    bool awaiting_spawner;     // While starting: the spawner hasn't told us the pid yet (see ask_spawner()).
+    struct launch {            // What start() leaves for launched() when it isn't launched right away.
+        bool respawn;
+        int out_fd;            // The child's stdout,
+        bool own_out_fd;       // which we close once it's launched (unless it's the collector's).
+        off_t banner_at;
+    } launching;
+    log_collector *collector;  // With "output=collect" or a lastlog. Outlives the process, so the pipe does too.
+    struct proc_usage usage;   // Of the current pid (and its children). See start_proc_sampling().
+    std::pair<int,uint64_t> spawn_queue_key; // While queued: (-priority, when we got in line)
+    bool queued_respawn;
+    int adopted_pid;           // Not our child, so no wait()ing for it. See adopt().
+    int adopted_fd;            // A pidfd that gets readable when adopted_pid exits,
+    timer_queue::timer_id adopted_timer; // or, without pidfds, when to check on it next.
 
     // Something important to warn the user about.
     std::list<string> whine_list;
     string get_and_clear_whines();
 
-    daemon(std::string config_file, class user *user);
+    daemon(std::string config_file, class user *user, int config_fd = -1); // config_fd: config_file, already open
+    ~daemon();
 
     void load_config();
+    void load_config(int fd);
     bool exists();
     std::string log_file();
+    std::string lastlog();
     std::string state_str() { return _state_str[current.state]; }
-    int fork_setuid_exec(string command, map<string,string> env = the_empty_map);
 
     void start(bool respawn=false);
+    void queue_start(bool respawn=false); // start() once there's a spawn slot free.
     void stop();
-    void respawn();
-    void reap();
+    void exited(int status); // Our pid has been wait()ed for.
+    void adopt(int pid, uint64_t pid_start, time_t started, bool was_stopping); // A process an earlier us left running.
+    void spawner_answered(const spawner_answer &answer); // About our ask_spawner().
+    void spawner_gave_up(); // It's never going to answer, so launch it ourselves.
+    void respawn(int status);
+    void reap(int status);
 
     time_t cooldown_remaining();
+    void cooldown_expired();
 
     std::map<std::string,std::string> to_map();
     void from_map(map<string,string> data);
+
+  private:
+    void set_pid(int pid);
+    void launch(bool respawn);
+    void launched(int pid, int status_fd);
+    void close_launch_fd();
+    void forget_spawner();
+    void schedule_cooldown(int64_t deadline);
+    void changed(const char *event, int value = 0);
+    std::string log_banner();
+    int open_log(off_t *banner_at);
+    void index_start(int log_fd, off_t banner_at, int pid);
+    std::string exec_path(std::string program);
+    void check_exec_status();
+    void close_exec_status();
+    void dequeue();
+    void watch_adopted();
+    void check_adopted();
+    void unwatch_adopted();
+    void adopted_exited();
 };
 
-bool daemon_compare(class daemon *a, class daemon *b);
+// Starting a lot of daemons at once (autostart, a rescan that finds a pile of new ones, a bunch of cooldowns
+// running out together) goes through a queue so that no more than max_concurrent_spawns of them are
+// "starting" at the same time. 0 means no limit.
+void set_max_concurrent_spawns(size_t max);
+void start_queued_daemons(); // Call from the main loop.
+
+// A child that daemon_by_pid() didn't know. One the spawner launched can exit before we hear its pid.
+void unclaimed_child_exited(int pid, int status);
+// Before a re-exec: the spawner's answers can't follow us, so wait (a second, at most) for the ones it owes us,
+// and launch anything it doesn't get to ourselves.
+void finish_spawner_requests();
+
+// For daemons that don't say ("lastlog-size" in daemon-manager.conf).
+void set_default_lastlog_size(size_t size);
+
+// The cooldown settings in settings, with the defaults for anything that isn't there. Throws if one is bad.
+struct cooldown_backoff backoff_settings(map<string,string> settings);
+void set_default_backoff(struct cooldown_backoff backoff); // For daemons that don't say (from daemon-manager.conf).
+
+// Called on every state change so that "watch" subscribers can be told about it. The event is one of "queued",
+// "start", "respawn", "running" (the exec after a start or respawn worked), "stop", "exit" (value is the wait() status, or -1 if the daemon never really started or was adopted), "cooldown"
+// (value is the number of seconds) or "cooldown-over".
+extern std::function<void(class daemon *d, const char *event, int value)> state_change_hook;
+
+class daemon *daemon_by_pid(int pid);
 
 // Use as a unary predicate for find_if and similar.
 class daemon_id_match {
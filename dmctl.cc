@@ -19,6 +19,7 @@
 #include "stringutil.h"
 #include "strprintf.h"
 #include "options.h"
+#include "log-index.h"
 
 using namespace std;
 
@@ -27,25 +28,49 @@ static void usage(char *me, int exit_code)
     printf("Usage:\n"
            "\t%s list|rescan\n"
            "\t%s [<daemon-id>] status\n"
+           "\t%s [<daemon-id>] status --json [--state=<state>] [--user=<user>] [--prefix=<id-prefix>] [--fields=<field>,...]\n"
+           "\t%s [<daemon-id>] watch\n"
            "\t%s <daemon-id> start|stop|restart\n"
-           "\t%s <daemon-id> log|tail\n"
+           "\t%s <daemon-id> log|tail|lastlog|starts\n"
+           "\t%s <daemon-id> log [--since=<time>] [--until=<time>]\n"
            "\t%s <daemon-id> edit\n"
-           "\t%s <daemon-id> kill -SIGNAL\n", me, me, me, me, me, me);
+           "\t%s <daemon-id> kill -SIGNAL\n", me, me, me, me, me, me, me, me, me);
     exit(exit_code);
 }
 
 static string do_command(string command, int command_socket_fd);
 static string canonify(string id, int command_socket_fd);
-static void do_log(string id, int command_socket_fd);
+static void do_log(string id, int command_socket_fd, string since, string until);
+static void do_starts(string id, int command_socket_fd);
 static void do_tail(string id, int command_socket_fd);
 static void do_edit(string id, int command_socket_fd);
 static void do_kill(options o, string id, int command_socket_fd);
+static void do_watch(string id, int command_socket_fd);
+
+// One of the "status-json" filters. They go over space separated, so a value can't have any in it.
+static string filter_term(const char *key, string value)
+{
+    if (value.find_first_of(" \t\r\n") != value.npos)
+        errx(1, "Can't filter on %s \"%s\": it has whitespace in it.", key, value.c_str());
+    return string(" ") + key + "=" + value;
+}
 
 int main(int argc, char **argv)
 {
     options o(argc, argv, argc > 2 && strcmp(argv[2], "kill") == 0 ? 2 : -1);
     if (o.get("version"))   { printf("dmctl version " VERSION "\n"); exit(EXIT_SUCCESS); }
     if (o.get("help", 'h')) usage(argv[0], EXIT_SUCCESS);
+    bool json = o.get("json");
+    string filters; // Passed through to "status-json" for daemon-manager to deal with.
+    if (o.get("state",  arg_required)) filters += " state="  + join(o.argm, ",");
+    if (o.get("user",   arg_required)) filters += filter_term("user",   o.arg);
+    if (o.get("prefix", arg_required)) filters += filter_term("prefix", o.arg);
+    if (o.get("fields", arg_required)) filters += " fields=" + join(o.argm, ",");
+    if (!json && !filters.empty()) usage(argv[0], EXIT_FAILURE);
+    string since, until;
+    if (o.get("since", arg_required)) since = o.arg;
+    if (o.get("until", arg_required)) until = o.arg;
+    if ((!since.empty() || !until.empty()) && (o.args.size() != 2 || o.args[1] != "log")) usage(argv[0], EXIT_FAILURE);
     unsigned max_args = o.args.size() > 2 && o.args[1] == "kill" ? 3 : 2;
     if (o.bad_args() || o.args.size() > max_args) usage(argv[0], EXIT_FAILURE);
 
@@ -70,13 +95,21 @@ int main(int argc, char **argv)
 
     try {
         if      (command == "log")
-            do_log(id, command_socket);
+            do_log(id, command_socket, since, until);
+        else if (command == "starts")
+            do_starts(id, command_socket);
         else if (command == "tail")
             do_tail(id, command_socket);
         else if (command == "edit")
             do_edit(id, command_socket);
         else if (command == "kill")
             do_kill(o, id, command_socket);
+        else if (command == "watch")
+            do_watch(id, command_socket);
+        else if (command == "status" && json) {
+            string resp = do_command("status-json" + (id.empty() ? "" : filter_term("id", id)) + filters, command_socket);
+            printf("%s", resp.c_str());
+        }
         else {
             string resp = do_command(command + string(" ") + id, command_socket); /* The daemon still takes args the old way ("start <daemon-id>"). */
             printf("%s", resp.c_str());
@@ -88,41 +121,52 @@ int main(int argc, char **argv)
     }
 }
 
-static bool wait_response(int command_socket_fd, bool block)
+static bool wait_response(int command_socket_fd, int timeout_ms)
 {
     struct pollfd fd[1];
     fd[0].fd = command_socket_fd;
     fd[0].events = POLLIN;
-    int got = poll(fd, 1, block ? -1 : 0);
+    int got = poll(fd, 1, timeout_ms);
     if (got < 0)  err(1, "Poll failed");
     return got != 0;
 }
 
 static string do_command(string command, int command_socket_fd)
 {
+    command += '\n'; // daemon-manager only runs whole lines.
     int wrote = write(command_socket_fd, command.c_str(), command.length());
     if (!wrote)   errx(1, "Write to command fifo failed.");
     if (wrote < 0) {
         // If daemon-manager is fast it could have already spewed an error at us and closed the connection, causing our write to fail.
         // To detect this we see if there's something for us to read on the socket. If not, then the error was legit--report it.
         int saved_errno = errno;
-        if (!wait_response(command_socket_fd, false)) {
+        if (!wait_response(command_socket_fd, 0)) {
             errno = saved_errno;
             err(1, "Write to command fifo failed");
         }
     }
 
-    if (!wait_response(command_socket_fd, true))
-        err(1, "Poll timed out.");
-
+    // Responses end with a NUL and can come in pieces, so keep reading until we see it. Older versions of
+    // daemon-manager didn't send the NUL, but they always wrote their whole response at once--so if things
+    // go quiet for a while after we've gotten something, that's the end.
     string out;
     while (1) {
-        char buf[256];
-        int red = read(command_socket_fd, buf, sizeof(buf)-1);
-        if (red == 0 || red < 0 && errno == EAGAIN) break; // done.
+        char buf[4096];
+        int red = read(command_socket_fd, buf, sizeof(buf));
+        if (red > 0) {
+            out.append(buf, red);
+            size_t end = out.find('\0');
+            if (end == out.npos) continue;
+            out.resize(end);
+            break;
+        }
+        if (red == 0) break; // done.
+        if (red < 0 && errno == EAGAIN) {
+            if (wait_response(command_socket_fd, out.empty() ? -1 : 1000)) continue;
+            break;
+        }
         if (red < 0 && errno == ECONNRESET && !out.empty()) break; // Don't whine if they sent a message but our next tentative read got closed down.
         if (red < 0)   err(1, "No response from daemon-manager");
-        out.append(buf, red);
     }
     if (out.empty()) errx(1, "No response from daemon-manager.");
 
@@ -179,11 +223,78 @@ static string find_log_file(string id, int command_socket_fd)
     return log_file;
 }
 
-static void do_log(string id, int command_socket_fd)
+// "@<seconds since the epoch>", "-<duration>" (that long ago: 90, 30m, 2h, 1d), or a local date and/or time
+// ("2026-01-31 03:12", "2026-01-31", "03:12:30"--just a time means today).
+static time_t parse_time(string when)
+{
+    char *end;
+    if (when[0] == '@') {
+        long long t = strtoll(when.c_str() + 1, &end, 10);
+        if (end != when.c_str() + 1 && !*end) return t;
+    }
+    if (when[0] == '-') {
+        long long ago = strtoll(when.c_str() + 1, &end, 10);
+        const char *units = "smhd";
+        const long long scale[] = { 1, 60, 60*60, 24*60*60 };
+        if (end != when.c_str() + 1 && (!*end || !end[1] && strchr(units, *end)))
+            return time(NULL) - ago * (*end ? scale[strchr(units, *end) - units] : 1);
+    }
+    const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d", "%H:%M:%S", "%H:%M" };
+    for (size_t i = 0; i < sizeof(formats)/sizeof(*formats); i++) {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm); // For the date when there's only a time.
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        const char *parsed = strptime(when.c_str(), formats[i], &tm);
+        if (parsed && !*parsed) {
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+    }
+    throw_str("Can't make sense of the time \"%s\"", when.c_str());
+    return 0; // Can't happen--just here to shut gcc up.
+}
+
+// Just the part between since and until. The log's index says where that is, so we only read what we show.
+static void show_log_range(string log_file, string since, string until)
+{
+    int log_fd = open(log_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (log_fd < 0) throw_strerr("Couldn't open %s", log_file.c_str());
+    log_index index(log_file);
+    try { index.open_for_read(log_fd); }
+    catch (std::exception &e) { close(log_fd); throw_str("%s (--since and --until need one)", e.what()); }
+    struct stat st;
+    fstat(log_fd, &st) == 0 || throw_strerr("Couldn't stat %s", log_file.c_str());
+    off_t from = since.empty() ? 0          : index.offset_since(parse_time(since));
+    off_t to   = until.empty() ? st.st_size : index.offset_until(parse_time(until), st.st_size);
+
+    FILE *out = stdout;
+    if (isatty(STDOUT_FILENO)) {
+        const char *pager = getenv("PAGER") ? getenv("PAGER") : "less";
+        out = popen(pager, "w");
+        if (!out) throw_strerr("Couldn't run %s", pager);
+    }
+    char buf[64*1024];
+    for (off_t at = from; at < to; ) {
+        ssize_t red = pread(log_fd, buf, min((off_t)sizeof(buf), to - at), at);
+        if (red < 0) throw_strerr("Couldn't read %s", log_file.c_str());
+        if (red == 0) break; // It got shorter while we were reading.
+        if (fwrite(buf, 1, red, out) != (size_t)red) break; // They quit the pager.
+        at += red;
+    }
+    if (out != stdout)
+        pclose(out);
+    close(log_fd);
+}
+
+static void do_log(string id, int command_socket_fd, string since, string until)
 {
     if (id == "") throw_str("\"log\" needs an argument");
     string log_file = find_log_file(id, command_socket_fd);
 
+    if (!since.empty() || !until.empty())
+        return show_log_range(log_file, since, until);
+
     if (isatty(STDOUT_FILENO)) {
         getenv("PAGER") && execl(getenv("PAGER"), getenv("PAGER"), log_file.c_str(), NULL);
         execlp("less", "less", log_file.c_str(), NULL);
@@ -193,6 +304,27 @@ static void do_log(string id, int command_socket_fd)
     throw_str("Couldn't run $PAGER, less, more, or cat on %s", log_file.c_str());
 }
 
+static void do_starts(string id, int command_socket_fd)
+{
+    if (id == "") throw_str("\"starts\" needs an argument");
+    string log_file = find_log_file(id, command_socket_fd);
+    int log_fd = open(log_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (log_fd < 0) throw_strerr("Couldn't open %s", log_file.c_str());
+    log_index index(log_file);
+    try { index.open_for_read(log_fd); }
+    catch (...) { close(log_fd); throw; }
+    close(log_fd);
+
+    printf("%-19s %9s %12s\n", "started", "pid", "offset");
+    vector<log_index::entry> starts = index.starts();
+    for (vector<log_index::entry>::iterator s = starts.begin(); s != starts.end(); s++) {
+        time_t t = s->time;
+        char when[20];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("%-19s %9d %12llu\n", when, s->pid, (unsigned long long)s->offset);
+    }
+}
+
 static void do_tail(string id, int command_socket_fd)
 {
     if (id == "") throw_str("\"tail\" needs an argument");
@@ -238,6 +370,37 @@ static void do_kill(options o, string id, int command_socket_fd)
     do_command(strprintf("kill-%d %s", signum, id.c_str()), command_socket_fd);
 }
 
+static void do_watch(string id, int command_socket_fd)
+{
+    string command = "watch " + id + "\n";
+    write(command_socket_fd, command.c_str(), command.length()) == (ssize_t)command.length() || throw_strerr("Write to command socket failed");
+
+    // The first line says whether daemon-manager took the subscription. After that it's one event per line until
+    // one of us goes away.
+    string out;
+    bool subscribed = false;
+    while (1) {
+        char buf[4096];
+        int red = read(command_socket_fd, buf, sizeof(buf));
+        if (red == 0) break;
+        if (red < 0 && errno == EAGAIN) { wait_response(command_socket_fd, -1); continue; }
+        if (red < 0) throw_strerr("Read from command socket failed");
+        out.append(buf, red);
+        if (!subscribed) {
+            size_t eol = out.find('\n');
+            if (eol == out.npos) continue;
+            if (out.substr(0, eol) != "OK")
+                throw std::runtime_error(out.substr(0, out.find('\0')));
+            out.erase(0, eol+1);
+            subscribed = true;
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        out.clear();
+    }
+    if (!subscribed) throw_str("No response from daemon-manager");
+}
+
 /* Magic quoting to transition to asciidoc mode
 ////
 
@@ -253,8 +416,11 @@ SYNOPSIS
 --------
   dmctl list|rescan
   dmctl [<daemon-id>] status
+  dmctl [<daemon-id>] status --json [--state=<state>] [--user=<user>] [--prefix=<id-prefix>] [--fields=<field>,...]
+  dmctl [<daemon-id>] watch
   dmctl <daemon-id> start|stop|restart
-  dmctl <daemon-id> log|tail
+  dmctl <daemon-id> log|tail|lastlog|starts
+  dmctl <daemon-id> log [--since=<time>] [--until=<time>]
   dmctl <daemon-id> kill -SIGNAL
 
 DESCRIPTION
@@ -282,7 +448,15 @@ COMMANDS
 
     'state';;
 
-      One of "`stopped`", "`running`", "`stopping`", "`coolingdown`".
+      One of "`stopped`", "`queued`", "`starting`", "`running`", "`stopping`", "`coolingdown`".
+      +
+      A daemon is "`queued`" while it waits its turn to be started (see
+      'max-concurrent-spawns' in 'daemon-manager.conf(5)').
+      +
+      A daemon is "`starting`" from the time it is launched until its command
+      has actually been executed. If that fails (because its 'dir' doesn't exist,
+      for instance) it goes back to "`stopped`" and the reason shows up the next
+      time you run 'status'.
       +
       The cooling down state happens when the daemon starts respawning too quickly. In
       order to prevent too much resource utilization, 'daemon-manager(1)' will require
@@ -299,7 +473,8 @@ COMMANDS
 
     'cooldown';;
 
-      The number of seconds left in the cooldown period.
+      The number of seconds left in the cooldown period (until the daemon is
+      respawned).
 
     'uptime';;
 
@@ -310,6 +485,73 @@ COMMANDS
       The total number of seconds the daemon has been running for since the last
       start.
 
+    'cpu';;
+
+      How much CPU the daemon has been using lately (100% is one whole CPU).
+
+    'rss';;
+
+      How much memory the daemon is using (its resident set size).
+
+    'fds';;
+
+      How many files and sockets the daemon has open.
+      +
+      These three add up all of the daemon's processes: the one
+      'daemon-manager(1)' started, everything started by it (like the program a
+      ``start'' line's shell runs), and anything in a process group it leads.
+      They come from '/proc' every 'stats-interval' (see
+      'daemon-manager.conf(5)'), so they can be a little behind, and are ``-''
+      until the first look after a start. This is only available on Linux.
+
+    'output';;
+
+      How fast (in bytes per second, over the last second or so) the daemon is
+      writing to its log. Only daemons with ``output=collect'' (see
+      'daemon.conf(5)') have this--for the rest it's ``-''.
+
+*['<daemon-id>'] status --json* [*--state*='<state>'] [*--user*='<user>'] [*--prefix*='<id-prefix>'] [*--fields*='<field>,...']::
+
+  This is like 'status' but is meant for programs instead of people. It prints
+  a JSON array with one object per daemon (one per line), containing these
+  fields:
+
+    id, name, user, config_file, current.state, current.pid, current.respawns,
+    current.cooldown, current.cooldown_start, cooldown_remaining, next_attempt,
+    current.start_time, current.respawn_time, output_bytes, output_rate,
+    cpu_percent, cpu_ms, rss, fds, processes
+
+  Times are seconds since the epoch and durations are in seconds. 'next_attempt'
+  is when a daemon that is cooling down will be respawned (0 if it isn't), and
+  'current.cooldown' is its cooldown before the random variation (see 'cooldown'
+  in 'daemon.conf(5)'). 'output_bytes' is how much the daemon has written to
+  its log and 'output_rate' is how much per second (both 0 unless it has
+  ``output=collect''). 'cpu_percent', 'rss' (in bytes) and 'fds' are the
+  'status' columns, 'cpu_ms' is the CPU time used since the daemon was started
+  (in milliseconds), and 'processes' is how many processes they add up.
+  Everything except 'id', 'name', 'user', 'config_file' and 'current.state' is
+  a number.
+  +
+  The filtering is done by 'daemon-manager(1)', so asking for less is cheaper:
+
+    '--state';;
+
+      Only show daemons in this state ("`stopped`", "`queued`", "`starting`",
+      "`running`", "`stopping`", or "`coolingdown`"). May be given more than once, or as a comma separated
+      list.
+
+    '--user';;
+
+      Only show daemons belonging to this user.
+
+    '--prefix';;
+
+      Only show daemons whose ids start with this.
+
+    '--fields';;
+
+      Only include these fields (comma separated), in this order.
+
 *rescan*::
 
   Upon receiving this command, 'daemon-manager(1)' will look through the user's
@@ -319,6 +561,72 @@ COMMANDS
   +
   It is not necessary to issue the 'rescan' command if a config file has been
   edited or deleted. 'start' and 'stop' will catch those 2 cases respectively.
+  +
+  On systems with inotify (Linux), 'daemon-manager(1)' notices new config files
+  on its own and 'rescan' is only needed if a user's daemon directory did not
+  exist when 'daemon-manager(1)' started.
+
+*['<daemon-id>'] watch*::
+
+  This prints events as they happen to the daemons you can manage (or just to
+  '<daemon-id>', if it's given) until it is interrupted. Each event is a line of
+  JSON like this:
+
+    {"time": 1700000000, "event": "exit", "id": "bob/web", "state": "stopped", "pid": 1234, "status": 1}
+  +
+  'time' is in seconds since the epoch, and 'state' and 'pid' are the daemon's
+  state and pid after the event--except for 'exit', where 'pid' is the process
+  that exited (the daemon has no pid afterwards). 'event' is one of:
+
+    'new';;
+
+      A new config file was loaded.
+
+    'queued';;
+
+      The daemon is waiting its turn to be started or respawned.
+
+    'start';;
+
+      The daemon was started.
+
+    'respawn';;
+
+      The daemon was restarted after quitting unexpectedly.
+
+    'running';;
+
+      The daemon's command was successfully executed after a 'start' or
+      'respawn'. If it couldn't be, you get an 'exit' with a 'status' of 127
+      instead.
+
+    'stop';;
+
+      The daemon was asked to stop.
+
+    'exit';;
+
+      The daemon quit. 'pid' is the process that quit, and 'status' is its exit
+      code (or 'signal' is the signal that killed it). If neither is there then
+      it couldn't even be launched (its config file has gone bad, for instance).
+
+    'cooldown';;
+
+      The daemon is respawning too quickly and won't be restarted for another
+      'cooldown' seconds.
+
+    'cooldown-over';;
+
+      The cooldown period is over and the daemon is about to be respawned.
+
+    'cull';;
+
+      The daemon's config file was deleted and it has been forgotten.
+
+  +
+  If the events come faster than they are read, 'daemon-manager(1)' will throw
+  some away and send a "`dropped`" event saying how many were lost. Use 'status
+  --json' to find out where things stand after that.
 
 *'<daemon-id>' start*::
 
@@ -348,11 +656,43 @@ COMMANDS
   +
   If this command is part of a pipeline, then 'cat' will always be used.
 
+*'<daemon-id>' log* [*--since*='<time>'] [*--until*='<time>']::
+
+  This shows just the part of the log written between the two times (either
+  can be left off). 'daemon-manager(1)' keeps an index next to the log
+  (``_<daemon>_.log.idx'') that says what was written when, so this jumps
+  straight to the right place instead of reading the whole file. It goes to
+  the pager ('PAGER', or 'less') if stdout is a terminal.
+  +
+  '<time>' can be a local date and time (`2026-01-31 03:12`, `2026-01-31
+  03:12:30`, or just `2026-01-31`), a time today (`03:12`), how long ago
+  (`-90` seconds, `-30m`, `-2h`, `-1d`), or seconds since the epoch
+  (`@1700000000`).
+  +
+  With ``output=collect'' the index has an entry at least every 64KB of output,
+  so a little from before '--since' (or after '--until') may show up too. With
+  ``output=log'' the daemon writes its log itself and only the starts are
+  indexed, so you get whole runs.
+
+*'<daemon-id>' starts*::
+
+  This lists when the daemon identified by <daemon-id> was started (or
+  respawned), with the pid and where the start's banner is in the log file,
+  from the log's index.
+
 *'<daemon-id>' tail*::
 
   This runs "tail -f" on the log file of the daemon identified by
   <daemon-id>.
 
+*'<daemon-id>' lastlog*::
+
+  This prints the most recent output of the daemon identified by <daemon-id>,
+  which 'daemon-manager(1)' keeps in memory even when the output isn't being
+  logged. It's handy for finding out why a daemon is cooling down. Only as much
+  as the daemon's 'lastlog-size' (see 'daemon.conf(5)') is kept, and each start
+  is marked with the same banner that goes in log files.
+
 *'<daemon-id>' edit*::
 
   This launches your editor on the config file identified by <daemon-id> (using
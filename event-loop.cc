@@ -0,0 +1,225 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "event-loop.h"
+#include "posix-util.h"
+#include "strprintf.h"
+#include "log.h"
+#include "foreach.h"
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef __linux__
+#  include <sys/epoll.h>
+#  include <sys/signalfd.h>
+#  include <sys/timerfd.h>
+#endif
+
+using namespace std;
+
+event_loop *main_loop;
+
+void event_loop::dispatch(int fd, int events)
+{
+    if (fd == signal_fd)
+        return read_signals();
+    auto w = fds.find(fd);
+    if (w == fds.end()) return; // Removed by an earlier handler in this same batch.
+    fd_handler handler = w->second.handler; // Copy, since the handler is allowed to remove itself.
+    handler(fd, events);
+}
+
+#ifdef __linux__
+
+static uint32_t epoll_events(int events)
+{
+    // A half closed socket is only news to someone reading it. Someone just writing would hear about it forever.
+    return (events & event_loop::ev_read  ? (uint32_t)(EPOLLIN | EPOLLRDHUP) : 0) |
+           (events & event_loop::ev_write ? (uint32_t)EPOLLOUT : 0);
+}
+
+event_loop::event_loop()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw_strerr("epoll_create1() failed");
+
+    sigset_t none;
+    sigemptyset(&none);
+    signal_fd = signalfd(-1, &none, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) throw_strerr("signalfd() failed");
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) throw_strerr("timerfd_create() failed");
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == 0 || throw_strerr("Couldn't add signalfd to epoll");
+    ev.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev)  == 0 || throw_strerr("Couldn't add timerfd to epoll");
+}
+
+event_loop::~event_loop()
+{
+    close(timer_fd);
+    close(signal_fd);
+    close(epoll_fd);
+}
+
+void event_loop::add_fd(int fd, int events, fd_handler handler)
+{
+    struct epoll_event ev = {};
+    ev.events = epoll_events(events);
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 || throw_strerr("Couldn't add fd %d to epoll", fd);
+    fds[fd] = (watch) { events, handler };
+}
+
+void event_loop::set_events(int fd, int events)
+{
+    if (!fds.count(fd) || fds[fd].events == events) return;
+    struct epoll_event ev = {};
+    ev.events = epoll_events(events);
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0 || throw_strerr("Couldn't modify fd %d in epoll", fd);
+    fds[fd].events = events;
+}
+
+void event_loop::remove_fd(int fd)
+{
+    if (!fds.count(fd)) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    fds.erase(fd);
+}
+
+void event_loop::add_signal(int sig, signal_handler handler)
+{
+    signals[sig] = handler;
+    sigset_t mask;
+    sigemptyset(&mask);
+    foreach(auto s, signals)
+        sigaddset(&mask, s.first);
+    sigprocmask(SIG_BLOCK, &mask, NULL)                           == 0 || throw_strerr("Couldn't block signal %d", sig);
+    signalfd(signal_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC) == signal_fd || throw_strerr("Couldn't add signal %d to signalfd", sig);
+}
+
+void event_loop::read_signals()
+{
+    struct signalfd_siginfo si;
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si))
+        if (signals.count(si.ssi_signo))
+            signals[si.ssi_signo](si.ssi_signo);
+}
+
+void event_loop::wait(int64_t deadline_ms)
+{
+    struct itimerspec when = {};
+    if (deadline_ms >= 0) {
+        when.it_value.tv_sec  = deadline_ms / 1000;
+        when.it_value.tv_nsec = deadline_ms % 1000 * 1000000 + 1; // All zeros would disarm it.
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL) == 0 || throw_strerr("timerfd_settime() failed");
+
+    struct epoll_event ev[64];
+    int got = epoll_wait(epoll_fd, ev, sizeof(ev)/sizeof(*ev), -1);
+    if (got < 0 && errno != EINTR)
+        log(LOG_ERR, "epoll_wait() failed: %s\n", strerror(errno));
+
+    for (int i=0; i<got; i++) {
+        if (ev[i].data.fd == timer_fd) {
+            uint64_t expirations;
+            read(timer_fd, &expirations, sizeof(expirations));
+            continue;
+        }
+        dispatch(ev[i].data.fd, (ev[i].events & EPOLLIN               ? ev_read   : 0) |
+                                (ev[i].events & EPOLLOUT              ? ev_write  : 0) |
+                                (ev[i].events & (EPOLLHUP|EPOLLRDHUP) ? ev_hangup : 0) |
+                                (ev[i].events & EPOLLERR              ? ev_error  : 0));
+    }
+}
+
+#else /* !__linux__ */
+
+static int signal_pipe[2] = { -1, -1 };
+static void signal_to_pipe(int sig)
+{
+    int saved_errno = errno;
+    unsigned char s = sig;
+    write(signal_pipe[1], &s, 1);
+    errno = saved_errno;
+}
+
+event_loop::event_loop() : timer_fd(-1), epoll_fd(-1)
+{
+    if (signal_pipe[0] < 0) {
+        pipe(signal_pipe) == 0 || throw_strerr("Couldn't create signal pipe");
+        for (int i=0; i<2; i++) {
+            fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC) == -1 && throw_strerr("Couldn't set signal pipe to close on exec");
+            fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK) == -1 && throw_strerr("Couldn't set signal pipe to non-blocking");
+        }
+    }
+    signal_fd = signal_pipe[0];
+}
+
+event_loop::~event_loop() {}
+
+void event_loop::add_fd(int fd, int events, fd_handler handler)
+{
+    fds[fd] = (watch) { events, handler };
+}
+
+void event_loop::set_events(int fd, int events)
+{
+    if (fds.count(fd))
+        fds[fd].events = events;
+}
+
+void event_loop::remove_fd(int fd)
+{
+    fds.erase(fd);
+}
+
+void event_loop::add_signal(int sig, signal_handler handler)
+{
+    signals[sig] = handler;
+    struct sigaction sa = {};
+    sa.sa_handler = signal_to_pipe;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL) == 0 || throw_strerr("Couldn't install handler for signal %d", sig);
+}
+
+void event_loop::read_signals()
+{
+    unsigned char sig;
+    while (read(signal_fd, &sig, 1) == 1)
+        if (signals.count(sig))
+            signals[sig](sig);
+}
+
+void event_loop::wait(int64_t deadline_ms)
+{
+    vector<struct pollfd> pfd;
+    pfd.push_back((struct pollfd) { signal_fd, POLLIN, 0 });
+    foreach(auto w, fds)
+        pfd.push_back((struct pollfd) { w.first, (short)((w.second.events & ev_read  ? POLLIN  : 0) |
+                                                         (w.second.events & ev_write ? POLLOUT : 0)), 0 });
+
+    int timeout = deadline_ms < 0 ? -1 : (int)max((int64_t)0, deadline_ms - monotonic_ms());
+    int got = poll(&pfd[0], pfd.size(), timeout);
+    if (got < 0 && errno != EINTR)
+        log(LOG_ERR, "poll() failed: %s\n", strerror(errno));
+
+    for (size_t i=0; got > 0 && i<pfd.size(); i++)
+        if (pfd[i].revents)
+            dispatch(pfd[i].fd, (pfd[i].revents & POLLIN   ? ev_read   : 0) |
+                                (pfd[i].revents & POLLOUT  ? ev_write  : 0) |
+                                (pfd[i].revents & POLLHUP  ? ev_hangup : 0) |
+                                (pfd[i].revents & (POLLERR|POLLNVAL) ? ev_error : 0));
+}
+
+#endif
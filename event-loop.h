@@ -0,0 +1,55 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <map>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+
+// Dispatches fd readiness and signals to handlers. File descriptors are registered once and stay registered
+// until removed. On Linux this is epoll, with signalfd for signals and a timerfd for the deadline. Elsewhere
+// it's poll() with a self-pipe for signals. Either way signals can't slip in between checking for work and
+// going to sleep.
+class event_loop {
+  public:
+    enum { ev_read = 1, ev_write = 2, ev_hangup = 4, ev_error = 8 };
+    typedef std::function<void(int fd, int events)> fd_handler;
+    typedef std::function<void(int sig)> signal_handler;
+
+    event_loop();
+    ~event_loop();
+
+    void add_fd(int fd, int events, fd_handler handler);
+    void set_events(int fd, int events);
+    void remove_fd(int fd);
+    bool watching(int fd) { return fds.count(fd); }
+
+    void add_signal(int sig, signal_handler handler);
+
+    // Wait until something happens (or until deadline_ms on the monotonic_ms() clock, -1 for forever) and
+    // call the handlers for whatever it was.
+    void wait(int64_t deadline_ms);
+
+  private:
+    struct watch {
+        int events;
+        fd_handler handler;
+    };
+    std::map<int,watch> fds;
+    std::map<int,signal_handler> signals;
+
+    int signal_fd;  // signalfd, or the read end of the self-pipe
+    int timer_fd;   // timerfd (Linux only)
+    int epoll_fd;   // Linux only
+    void dispatch(int fd, int events);
+    void read_signals();
+};
+
+// The one daemon-manager runs on, for things (like daemons waiting to hear if their exec worked) that aren't
+// handed one.
+extern event_loop *main_loop;
+
+#endif /* __EVENT_LOOP_H__ */
+
@@ -0,0 +1,360 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "log-collector.h"
+#include "event-loop.h"
+#include "posix-util.h"
+#include "strprintf.h"
+#include "log.h"
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+log_collector::log_collector(string path, uid_t uid, gid_t gid, int read_fd, int write_fd, time_t opened)
+        : ring(NULL), bytes_total(0), read_fd(read_fd), write_fd(write_fd), opened(opened), path(path), uid(uid), gid(gid),
+          log_fd(-1), log_size(0), index(path), indexed_offset(-1), use_splice(true), complained(false), window_start_ms(monotonic_ms()), window_bytes(0),
+          rate(0)
+{
+    limits = (struct limits) { 0, 0, 0 };
+    if (read_fd < 0 || write_fd < 0) {
+        int fd[2];
+        pipe(fd) == 0 || throw_strerr("Couldn't make a pipe for %s", path.c_str());
+        this->read_fd = fd[0];
+        this->write_fd = fd[1];
+    }
+    keep_across_exec(false);
+    fcntl(this->read_fd, F_SETFL, O_NONBLOCK); // The daemon's end stays blocking. It's their stdout, after all.
+    if (!this->opened)
+        this->opened = time(NULL);
+    open_log();
+    main_loop->add_fd(this->read_fd, event_loop::ev_read, [this](int, int) { drain(); });
+}
+
+log_collector::~log_collector()
+{
+    main_loop->remove_fd(read_fd);
+    close(read_fd);
+    close(write_fd);
+    if (log_fd >= 0)
+        close(log_fd);
+    index.close();
+    delete ring;
+}
+
+void log_collector::keep_across_exec(bool keep)
+{
+    fcntl(read_fd,  F_SETFD, keep ? 0 : FD_CLOEXEC);
+    fcntl(write_fd, F_SETFD, keep ? 0 : FD_CLOEXEC);
+    if (ring)
+        ring->keep_across_exec(keep);
+}
+
+void log_collector::set_path(string path)
+{
+    if (path == this->path) return;
+    drain(); // What's already been said goes where it was going.
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = -1;
+    index.close();
+    this->path = path;
+    opened = time(NULL);
+    complained = false;
+    open_log();
+}
+
+void log_collector::set_ring_size(size_t size)
+{
+    if (ring && ring->size == size) return;
+    drain();
+    output_ring *old = ring;
+    ring = size ? new output_ring(size) : NULL;
+    if (ring && old)
+        ring->append(old->contents());
+    delete old;
+}
+
+// Not O_APPEND since splice() won't write to those. Nobody else should be writing to it, so we just keep
+// track of the end ourselves.
+void log_collector::open_log()
+{
+    if (path.empty()) return;
+    log_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0750);
+    struct stat st;
+    if (log_fd < 0 || fchown(log_fd, uid, gid) < 0 || fstat(log_fd, &st) < 0) {
+        if (!complained)
+            log(LOG_ERR, "Couldn't open log file %s (output will be thrown away until it can be): %s\n", path.c_str(), strerror(errno));
+        complained = true;
+        if (log_fd >= 0) close(log_fd);
+        log_fd = -1;
+        return;
+    }
+    log_size = st.st_size;
+    index.path = log_index::path_for(path);
+    indexed_offset = -1;
+    try { index.open_for_append(log_fd, uid, gid); }
+    catch (std::exception &e) { log(LOG_WARNING, "%s (%s won't be indexed)\n", e.what(), path.c_str()); }
+}
+
+// Not for every write--just often enough that "dmctl log --since" doesn't have much to wade through.
+static const off_t index_spacing = 64*1024;
+
+void log_collector::add_to_index(log_index::entry_type type, off_t offset, int pid)
+{
+    try {
+        index.add(type, offset, pid);
+        indexed_offset = offset;
+    } catch (std::exception &e) { log(LOG_WARNING, "%s\n", e.what()); }
+}
+
+void log_collector::note_start(off_t offset, int pid)
+{
+    if (offset >= 0)
+        add_to_index(log_index::start, offset, pid);
+}
+
+bool log_collector::due_for_rotation()
+{
+    return log_fd >= 0 && log_size > 0 && (limits.max_size && log_size >= limits.max_size ||
+                                           limits.max_age  && time(NULL) - opened >= limits.max_age);
+}
+
+void log_collector::rotate()
+{
+    close(log_fd);
+    log_fd = -1;
+    index.close();
+    if (limits.keep <= 0) {
+        unlink(path.c_str());
+        unlink(log_index::path_for(path).c_str());
+    } else {
+        for (int i = limits.keep - 1; i > 0; i--) {
+            string from = strprintf("%s.%d", path.c_str(), i), to = strprintf("%s.%d", path.c_str(), i+1);
+            rename(from.c_str(), to.c_str());
+            rename(log_index::path_for(from).c_str(), log_index::path_for(to).c_str());
+        }
+        if (rename(path.c_str(), (path + ".1").c_str()) < 0)
+            log(LOG_ERR, "Couldn't rename %s to %s.1: %s\n", path.c_str(), path.c_str(), strerror(errno));
+        rename(log_index::path_for(path).c_str(), log_index::path_for(path + ".1").c_str());
+    }
+    opened = time(NULL);
+    open_log();
+    log(LOG_INFO, "Rotated %s\n", path.c_str());
+}
+
+void log_collector::drain()
+{
+    // Don't let one really chatty daemon hog the loop. Whatever's left will still be there next time around.
+    size_t budget = 1024*1024;
+    bool retry_open = true;
+    while (budget) {
+        if (log_fd < 0 && retry_open && !path.empty())
+            open_log();
+        if (due_for_rotation())
+            rotate();
+
+        ssize_t moved = -1;
+        bool wrote = false;
+        if (ring) { // Can't splice() through it, but the copy out of the pipe was going to happen anyway.
+            moved = ring->read_from(read_fd, min(ring->size, budget));
+            if (moved > 0 && log_fd >= 0 && ring->pwrite_last(log_fd, moved, log_size) < 0)
+                moved = -1; // Still in the ring, though.
+            wrote = true;
+        }
+#ifdef __linux__
+        if (!wrote && use_splice && log_fd >= 0) {
+            loff_t offset = log_size;
+            moved = splice(read_fd, NULL, log_fd, &offset, budget, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && errno == EINVAL)
+                use_splice = false; // Some filesystems can't. Fall through and do it the old fashioned way.
+            else
+                wrote = true;
+        }
+#endif
+        if (!wrote) {
+            char buf[64*1024];
+            moved = read(read_fd, buf, min(sizeof(buf), budget));
+            for (ssize_t done = 0, w; log_fd >= 0 && done < moved; done += w)
+                if ((w = pwrite(log_fd, buf + done, moved - done, log_size + done)) < 0) {
+                    moved = -1; // Report the write error below. What we read is lost either way.
+                    break;
+                }
+        }
+        if (moved == 0)
+            break;
+        if (moved < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            if (log_fd < 0) // There was nothing to write to, so it was the read. Going around again won't help.
+                break;
+            // Probably a full disk. Stop writing the log (but keep emptying the pipe so the daemon doesn't
+            // get stuck) until we can open it again.
+            if (!complained)
+                log(LOG_ERR, "Couldn't write to %s: %s\n", path.c_str(), strerror(errno));
+            complained = true;
+            if (log_fd >= 0) close(log_fd);
+            log_fd = -1;
+            retry_open = false;
+            continue;
+        }
+        if (log_fd >= 0) {
+            if (indexed_offset < 0 || log_size - indexed_offset >= index_spacing)
+                add_to_index(log_index::mark, log_size);
+            log_size += moved;
+            complained = false;
+        }
+        budget -= min((size_t)moved, budget);
+        count(moved);
+    }
+}
+
+off_t log_collector::append(const string &s)
+{
+    drain(); // So anything the last one said comes before this.
+    if (ring)
+        ring->append(s);
+    if (log_fd < 0) return -1;
+    off_t at = log_size;
+    ssize_t wrote = pwrite(log_fd, s.data(), s.size(), log_size);
+    if (wrote > 0)
+        log_size += wrote;
+    return at;
+}
+
+void log_collector::count(size_t bytes)
+{
+    bytes_total += bytes;
+    window_bytes += bytes;
+    bytes_per_sec(); // Starts a new window if it's time.
+}
+
+double log_collector::bytes_per_sec()
+{
+    int64_t now = monotonic_ms();
+    int64_t elapsed = now - window_start_ms;
+    if (elapsed >= 1000) {
+        rate = window_bytes * 1000.0 / elapsed;
+        window_start_ms = now;
+        window_bytes = 0;
+    }
+    return rate;
+}
+
+output_ring::output_ring(size_t size) : fd(-1), size(size)
+{
+#ifdef __linux__
+    fd = memfd_create("dm-lastlog", MFD_CLOEXEC);
+    if (fd < 0)
+        throw_strerr("Couldn't make a memfd");
+    if (ftruncate(fd, sizeof(struct header) + size) < 0) {
+        close(fd);
+        throw_strerr("Couldn't make a %zd byte memfd", size);
+    }
+#endif
+    map(size);
+    header->written = 0;
+}
+
+output_ring::output_ring(int fd) : fd(fd), size(0)
+{
+    struct stat st;
+    fstat(fd, &st) == 0 || throw_strerr("Couldn't stat lastlog fd %d", fd);
+    if ((size_t)st.st_size <= sizeof(struct header))
+        throw_str("lastlog fd %d is too small (%lld bytes)", fd, (long long)st.st_size);
+    map(st.st_size - sizeof(struct header));
+    keep_across_exec(false);
+}
+
+output_ring::~output_ring()
+{
+    munmap(header, sizeof(struct header) + size);
+    if (fd >= 0)
+        close(fd);
+}
+
+// Without a fd it's anonymous memory (and fresh ones come zeroed, same as a new memfd).
+void output_ring::map(size_t size)
+{
+    this->size = size;
+    void *mem = mmap(NULL, sizeof(struct header) + size, PROT_READ | PROT_WRITE, fd < 0 ? MAP_SHARED | MAP_ANON : MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        int saved_errno = errno;
+        if (fd >= 0) close(fd);
+        errno = saved_errno;
+        throw_strerr("Couldn't map a %zd byte lastlog", size);
+    }
+    header = (struct header *)mem;
+    data = (char *)mem + sizeof(struct header);
+}
+
+void output_ring::keep_across_exec(bool keep)
+{
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, keep ? 0 : FD_CLOEXEC);
+}
+
+size_t output_ring::segments(size_t length, char **first, size_t *first_length, char **second)
+{
+    length = min((uint64_t)length, min((uint64_t)size, header->written));
+    size_t start = (header->written - length) % size;
+    *first = data + start;
+    *first_length = min(length, size - start);
+    *second = data;
+    return length;
+}
+
+ssize_t output_ring::read_from(int fd, size_t max)
+{
+    size_t end = header->written % size;
+    max = min(max, size);
+    struct iovec iov[2] = { { data + end, min(max, size - end) },
+                            { data,       max - min(max, size - end) } };
+    ssize_t red = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (red > 0)
+        header->written += red;
+    return red;
+}
+
+ssize_t output_ring::pwrite_last(int fd, size_t length, off_t offset)
+{
+    char *first, *second;
+    size_t first_length;
+    length = segments(length, &first, &first_length, &second);
+    for (size_t done = 0; done < length; ) {
+        char *from = done < first_length ? first + done : second + (done - first_length);
+        size_t count = done < first_length ? first_length - done : length - done;
+        ssize_t w = pwrite(fd, from, count, offset + done);
+        if (w < 0)
+            return -1;
+        done += w;
+    }
+    return length;
+}
+
+void output_ring::append(const string &s)
+{
+    const char *from = s.data() + s.size() - min(s.size(), size); // Only the end fits.
+    for (size_t left = s.data() + s.size() - from; left; ) {
+        size_t end = header->written % size;
+        size_t count = min(left, size - end);
+        memcpy(data + end, from, count);
+        header->written += count;
+        from += count;
+        left -= count;
+    }
+}
+
+string output_ring::contents()
+{
+    char *first, *second;
+    size_t first_length;
+    size_t length = segments(size, &first, &first_length, &second);
+    return string(first, first_length) + string(second, length - first_length);
+}
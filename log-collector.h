@@ -0,0 +1,94 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __LOG_COLLECTOR_H__
+#define __LOG_COLLECTOR_H__
+
+#include "log-index.h"
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// The last few KB of a daemon's output, kept in memory so there's something to look at when it dies even if
+// nobody's keeping a log ("dmctl <id> lastlog"). It lives in a memfd on Linux so it survives our re-exec
+// like the pipe does. Elsewhere it's plain shared memory and starts over when we re-exec.
+class output_ring {
+  public:
+    explicit output_ring(size_t size);
+    explicit output_ring(int fd); // Adopt one from before a re-exec.
+    ~output_ring();
+
+    ssize_t read_from(int fd, size_t max);                   // Straight from fd into the ring. Returns what read() would.
+    ssize_t pwrite_last(int fd, size_t length, off_t offset); // Copy the last length bytes out to a file.
+    void append(const std::string &s);
+    std::string contents();
+    void keep_across_exec(bool keep);
+
+    int fd;      // -1 if there's nothing to hand across an exec
+    size_t size;
+
+  private:
+    struct header {
+        uint64_t written; // Ever. The next byte goes at written % size.
+    } *header;
+    char *data;
+    void map(size_t size);
+    size_t segments(size_t length, char **first, size_t *first_length, char **second); // The last length bytes, in order.
+};
+
+// Reads a daemon's output from a pipe (from the event loop) and writes it to its log file (if it has one--
+// path can be ""), rotating the file when it gets too big or too old. With a ring the output goes through
+// there on its way to the file. We're the only one writing the file, so rotating is just a rename--the
+// daemon never notices, and there's no copy-and-truncate race like with an external logrotate. The pipe
+// outlives the daemon's process so respawns (and our re-exec) keep using the same one.
+class log_collector {
+  public:
+    struct limits {
+        off_t max_size;  // 0 for no limit
+        time_t max_age;  // seconds, 0 for no limit
+        int keep;        // How many old ones to keep around (path.1, path.2, ...)
+    } limits;
+
+    output_ring *ring;                   // Ours. NULL if there isn't one.
+
+    // Adopts read_fd and write_fd if they're given (after a re-exec), otherwise makes a new pipe.
+    log_collector(std::string path, uid_t uid, gid_t gid, int read_fd = -1, int write_fd = -1, time_t opened = 0);
+    ~log_collector();
+
+    int output_fd() { return write_fd; } // The daemon's stdout and stderr.
+    off_t append(const std::string &s);  // For our own notes, like the "Starting" banner. Returns where it went in the log (-1 for nowhere).
+    void note_start(off_t offset, int pid); // Index a banner (once we know the pid).
+    void drain();                        // Copy whatever's in the pipe to the log.
+    void keep_across_exec(bool keep);    // Clear (or restore) close-on-exec on the pipe (and the ring).
+    void set_path(std::string path);     // In case the config changed.
+    void set_ring_size(size_t size);     // 0 for no ring. Keeps what's in the old one if it can.
+
+    uint64_t bytes_total;
+    double bytes_per_sec();
+
+    int read_fd, write_fd;
+    time_t opened;                       // When the current log file was started.
+
+  private:
+    std::string path;
+    uid_t uid;
+    gid_t gid;
+    int log_fd;
+    off_t log_size;
+    log_index index;
+    off_t indexed_offset;                // Of the last entry we added to the index, -1 if there isn't one yet.
+    void add_to_index(log_index::entry_type type, off_t offset, int pid = 0);
+    bool use_splice;
+    bool complained; // About not being able to write the log, so we don't say it over and over.
+
+    int64_t window_start_ms;             // For bytes_per_sec()
+    uint64_t window_bytes;
+    double rate;
+    void count(size_t bytes);
+
+    void open_log();
+    void rotate();
+    bool due_for_rotation();
+};
+
+#endif /* __LOG_COLLECTOR_H__ */
@@ -0,0 +1,162 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "log-index.h"
+#include "strprintf.h"
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char magic[8] = "dm-idx1"; // The number is the version of the entry format.
+
+// Which log the entries are for, so one that got renamed out of the way (by logrotate, say) and replaced
+// with a new one doesn't get read with the old one's index.
+struct header {
+    char magic[8];
+    uint64_t log_ino;
+};
+
+static bool read_header(int fd, struct header *h)
+{
+    return pread(fd, h, sizeof(*h), 0) == sizeof(*h) && memcmp(h->magic, magic, sizeof(magic)) == 0;
+}
+
+log_index::log_index(string log_path) : path(path_for(log_path)), fd(-1), last_time(0)
+{
+}
+
+log_index::~log_index()
+{
+    close();
+}
+
+void log_index::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+void log_index::open_for_append(int log_fd, uid_t uid, gid_t gid)
+{
+    close();
+    // We're root and it's in a directory the user owns, so it could be anything they like. Following a symlink
+    // (or a hard link) to somebody else's file would hand it to them and then truncate it.
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK, 0640);
+    if (fd < 0) throw_strerr("Couldn't open %s", path.c_str());
+    try {
+        struct stat log, st;
+        fstat(fd, &st) == 0 || throw_strerr("Couldn't stat %s", path.c_str());
+        if (!S_ISREG(st.st_mode) || st.st_nlink != 1)
+            throw_str("%s isn't a plain file (with no other links to it), so it can't be a log index", path.c_str());
+        fchown(fd, uid, gid) == 0 || throw_strerr("Couldn't change %s to uid %d gid %d", path.c_str(), uid, gid);
+
+        // Throw away anything we can't trust: a different format or log file, a half written entry from a
+        // crash, or entries past the end of a log that got truncated.
+        fstat(log_fd, &log) == 0 || throw_strerr("Couldn't stat the log for %s", path.c_str());
+        struct header h;
+        size_t entries = 0;
+        if (read_header(fd, &h) && h.log_ino == (uint64_t)log.st_ino)
+            entries = (st.st_size - sizeof(h)) / sizeof(entry);
+        else {
+            memcpy(h.magic, magic, sizeof(magic));
+            h.log_ino = log.st_ino;
+            ftruncate(fd, 0) == 0 && write(fd, &h, sizeof(h)) == sizeof(h) || throw_strerr("Couldn't start %s", path.c_str());
+        }
+        while (entries && at(entries-1).offset > (uint64_t)log.st_size)
+            entries--;
+        ftruncate(fd, sizeof(h) + entries * sizeof(entry)) == 0 || throw_strerr("Couldn't truncate %s", path.c_str());
+        last_time = entries ? at(entries-1).time : 0;
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+void log_index::add(entry_type type, off_t offset, int pid)
+{
+    if (fd < 0) return;
+    last_time = max(last_time, (int64_t)time(NULL));
+    entry e = { last_time, (uint64_t)offset, type, pid };
+    if (write(fd, &e, sizeof(e)) != sizeof(e)) {
+        int saved_errno = errno;
+        close(); // Better no index than a wrong one. It'll get opened (and fixed up) again along with the log.
+        errno = saved_errno;
+        throw_strerr("Couldn't write to %s", path.c_str());
+    }
+}
+
+void log_index::open_for_read(int log_fd)
+{
+    close();
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw_strerr("Couldn't open %s", path.c_str());
+    struct header h;
+    struct stat log;
+    if (!read_header(fd, &h)) {
+        close();
+        throw_str("%s isn't a log index (or is from a different version of daemon-manager)", path.c_str());
+    }
+    if (fstat(log_fd, &log) < 0 || h.log_ino != (uint64_t)log.st_ino) {
+        close();
+        throw_str("%s is for a different log file", path.c_str());
+    }
+}
+
+size_t log_index::size()
+{
+    struct stat st;
+    fstat(fd, &st) == 0 || throw_strerr("Couldn't stat %s", path.c_str());
+    return st.st_size < (off_t)sizeof(header) ? 0 : (st.st_size - sizeof(header)) / sizeof(entry);
+}
+
+log_index::entry log_index::at(size_t i)
+{
+    entry e;
+    pread(fd, &e, sizeof(e), sizeof(header) + i * sizeof(e)) == sizeof(e) || throw_strerr("Couldn't read entry %zd of %s", i, path.c_str());
+    return e;
+}
+
+size_t log_index::first_after(time_t t)
+{
+    size_t lo = 0, hi = size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (at(mid).time <= t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Everything before an entry was written no later than its time, so the last entry from before t is as late as
+// we can start without missing anything.
+off_t log_index::offset_since(time_t t)
+{
+    size_t i = first_after(t - 1);
+    return i == 0 ? 0 : at(i-1).offset;
+}
+
+// And everything after an entry was written no earlier than its time.
+off_t log_index::offset_until(time_t t, off_t log_size)
+{
+    size_t i = first_after(t);
+    return i == size() ? log_size : at(i).offset;
+}
+
+vector<log_index::entry> log_index::starts()
+{
+    vector<entry> out;
+    for (size_t i = 0, n = size(); i < n; i++) {
+        entry e = at(i);
+        if (e.type == start)
+            out.push_back(e);
+    }
+    return out;
+}
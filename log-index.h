@@ -0,0 +1,59 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __LOG_INDEX_H__
+#define __LOG_INDEX_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// A little file next to a log ("<log>.idx") that says where in the log things were written when, so dmctl
+// can jump straight to a time without reading everything before it. It's a short header followed by fixed
+// size entries in time order, so finding a time is a binary search with pread(). daemon-manager writes
+// it (and is the only one who does); dmctl reads it.
+//
+// An entry says that everything before offset was written no later than time, and everything after it no
+// earlier. The manager adds one at each start, and every so often as output comes in when it's the one
+// writing the log ("output=collect").
+class log_index {
+  public:
+    enum entry_type { start = 1, // A "Starting" banner. pid is the daemon's.
+                      mark  = 2, // Output that showed up at time.
+    };
+    struct entry {
+        int64_t time;
+        uint64_t offset;
+        int32_t type;
+        int32_t pid;
+    };
+
+    explicit log_index(std::string log_path); // The log's path, not the index's.
+    ~log_index();
+
+    // Writing. open_for_append() starts over if the index doesn't match log_fd, and drops anything that
+    // points past its end (it must have been truncated out from under us).
+    void open_for_append(int log_fd, uid_t uid, gid_t gid);
+    void add(entry_type type, off_t offset, int pid = 0); // Closes the index (and throws) if it can't.
+    void close();
+
+    // Reading.
+    void open_for_read(int log_fd);
+    size_t size();       // In entries.
+    entry at(size_t i);
+    off_t offset_since(time_t t); // Where to start reading to see everything from t on.
+    off_t offset_until(time_t t, off_t log_size); // Where to stop to see everything up to t.
+    std::vector<entry> starts();
+
+    static std::string path_for(std::string log_path) { return log_path + ".idx"; }
+
+    std::string path;
+
+  private:
+    int fd;
+    int64_t last_time; // Entries have to stay in order even if the clock goes backwards.
+    size_t first_after(time_t t); // Index of the first entry newer than t.
+};
+
+#endif /* __LOG_INDEX_H__ */
@@ -1,47 +1,163 @@
-//  Copyright (c) 2010-2013 David Caldwell <david@porkrind.org>
+//  Copyright (c) 2010-2026 David Caldwell <david@porkrind.org>
 //  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
 
 #include "passwd.h"
 #include "strprintf.h"
+#include "posix-util.h"
 #include <string>
+#include <map>
+#include <algorithm>
 #include <pwd.h>
 #include <grp.h>
+#include <unistd.h>
 
 using namespace std;
 
-int uid_from_name(string name)
+// getpw*() and getgr*() can mean a trip out to LDAP (or whatever NSS is hooked up to) and we're single
+// threaded, so we remember the answers--including "no such user"--for a while.
+template<class T> struct cached {
+    T value;
+    int64_t expires; // monotonic_ms()
+};
+
+struct group_entry {
+    bool valid;
+    vector<string> members;
+};
+
+static map<string, cached<pwent> >      pwent_by_name;
+static map<int,    cached<string> >     name_by_uid;
+static map<int,    cached<string> >     name_by_gid;
+static map<string, cached<group_entry> > group_by_name;
+static map<pair<string,gid_t>, cached<vector<gid_t> > > groups_by_user;
+static int64_t ttl_ms = 60*1000;
+static struct nss_cache_stats stats;
+
+template<class K, class T>
+static T lookup(map<K, cached<T> > &cache, const K &key, T (*fetch)(const K &key))
 {
-    struct passwd *p = getpwnam(name.c_str());
-    if (!p) return -1;
-    return p->pw_uid;
+    int64_t now = monotonic_ms();
+    auto c = cache.find(key);
+    if (c != cache.end() && c->second.expires > now) {
+        stats.hits++;
+        return c->second.value;
+    }
+    stats.misses++;
+    T value = fetch(key);
+    if (ttl_ms > 0)
+        cache[key] = (cached<T>) { value, now + ttl_ms };
+    return value;
 }
 
-string name_from_uid(int uid)
+void nss_cache_set_ttl(int seconds)
+{
+    ttl_ms = seconds * 1000LL;
+    nss_cache_flush();
+}
+
+void nss_cache_flush()
+{
+    pwent_by_name.clear();
+    name_by_uid.clear();
+    name_by_gid.clear();
+    group_by_name.clear();
+    groups_by_user.clear();
+}
+
+struct nss_cache_stats nss_cache_stats()
+{
+    return stats;
+}
+
+static string fetch_name_from_uid(const int &uid)
 {
     struct passwd *p = getpwuid(uid);
     if (!p) return strprintf("%d", uid);
     return string(p->pw_name);
 }
 
-string name_from_gid(int gid)
+static string fetch_name_from_gid(const int &gid)
 {
     struct group *g = getgrgid(gid);
     if (!g) return strprintf("%d", gid);
     return string(g->gr_name);
 }
 
-pwent::pwent(std::string user) : valid(0)
+static pwent fetch_pwent(const string &user)
 {
+    pwent pw;
     struct passwd *p = getpwnam(user.c_str());
     if (!p)
-        return;
-    valid = true;
-
-    name   = p->pw_name  ;
-    passwd = p->pw_passwd;
-    uid    = p->pw_uid   ;
-    gid    = p->pw_gid   ;
-    gecos  = p->pw_gecos ;
-    dir    = p->pw_dir   ;
-    shell  = p->pw_shell ;
+        return pw;
+    pw.valid = true;
+
+    pw.name   = p->pw_name  ;
+    pw.passwd = p->pw_passwd;
+    pw.uid    = p->pw_uid   ;
+    pw.gid    = p->pw_gid   ;
+    pw.gecos  = p->pw_gecos ;
+    pw.dir    = p->pw_dir   ;
+    pw.shell  = p->pw_shell ;
+    return pw;
+}
+
+static group_entry fetch_group(const string &name)
+{
+    group_entry group = { false, vector<string>() };
+    struct group *g = getgrnam(name.c_str());
+    if (!g)
+        return group;
+    group.valid = true;
+    for (int i=0; g->gr_mem[i]; i++)
+        group.members.push_back(string(g->gr_mem[i]));
+    return group;
+}
+
+static vector<gid_t> fetch_supplementary_groups(const pair<string,gid_t> &user)
+{
+#ifdef __APPLE__
+    typedef int group_t; // Yes, really.
+#else
+    typedef gid_t group_t;
+#endif
+    vector<group_t> groups(32);
+    int count;
+    while (count = groups.size(),
+           getgrouplist(user.first.c_str(), user.second, &groups[0], &count) < 0)
+        groups.resize(max((size_t)count, groups.size() * 2));
+    return vector<gid_t>(groups.begin(), groups.begin() + count);
+}
+
+int uid_from_name(string name)
+{
+    pwent pw(name);
+    if (!pw.valid) return -1;
+    return pw.uid;
+}
+
+string name_from_uid(int uid)
+{
+    return lookup(name_by_uid, uid, fetch_name_from_uid);
+}
+
+vector<gid_t> supplementary_groups(string user, gid_t gid)
+{
+    return lookup(groups_by_user, make_pair(user, gid), fetch_supplementary_groups);
+}
+
+string name_from_gid(int gid)
+{
+    return lookup(name_by_gid, gid, fetch_name_from_gid);
+}
+
+bool group_members(string name, vector<string> *members)
+{
+    group_entry group = lookup(group_by_name, name, fetch_group);
+    *members = group.members;
+    return group.valid;
+}
+
+pwent::pwent(std::string user)
+{
+    *this = lookup(pwent_by_name, user, fetch_pwent);
 }
@@ -1,14 +1,26 @@
-//  Copyright (c) 2010-2013 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Copyright (c) 2010-2026 David Caldwell <david@porkrind.org> -*- c++ -*-
 //  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
 #ifndef __PASSWD_H__
 #define __PASSWD_H__
 
 #include <string>
+#include <vector>
 #include <sys/types.h>
 
+// These all go through a cache (see passwd.cc).
 int uid_from_name(std::string name);
 std::string name_from_uid(int uid);
 std::string name_from_gid(int gid);
+bool group_members(std::string name, std::vector<std::string> *members); // false if there's no such group
+std::vector<gid_t> supplementary_groups(std::string user, gid_t gid);     // What initgroups() would give them
+
+void nss_cache_set_ttl(int seconds); // 0 turns the cache off.
+void nss_cache_flush();
+struct nss_cache_stats {
+    size_t hits;
+    size_t misses;
+};
+struct nss_cache_stats nss_cache_stats();
 
 class pwent {
   public:
@@ -9,14 +9,28 @@
 
 using namespace std;
 
-struct stat permissions::check(string file, int bad_modes, uid_t required_uid, gid_t required_gid)
+static void check_stat(const struct stat &st, const char *path, int bad_modes, uid_t required_uid, gid_t required_gid)
 {
-    const char *path = file.c_str();
-    struct stat st;
-    stat(path, &st) == 0 || throw_str("%s doesn't exist", path);
     if (st.st_mode & bad_modes & 0002)   throw_str("%s can't be world writable", path);
     if (st.st_mode & bad_modes & 0111)   throw_str("%s can't be executable", path);
     if (required_uid != (uid_t)-1 && st.st_uid != required_uid) throw_str("%s must be owned by \"%s\"", path, name_from_uid(required_uid).c_str());
     if (required_gid != (gid_t)-1 && st.st_gid != required_gid) throw_str("%s must have group \"%s\"",path, name_from_gid(required_gid).c_str());
+}
+
+struct stat permissions::check(string file, int bad_modes, uid_t required_uid, gid_t required_gid)
+{
+    const char *path = file.c_str();
+    struct stat st;
+    stat(path, &st) == 0 || throw_str("%s doesn't exist", path);
+    check_stat(st, path, bad_modes, required_uid, required_gid);
+    return st;
+}
+
+// Checking the fd we're about to read means nobody can swap the file out from under us in between.
+struct stat permissions::check(int fd, string file, int bad_modes, uid_t required_uid, gid_t required_gid)
+{
+    struct stat st;
+    fstat(fd, &st) == 0 || throw_strerr("Couldn't stat %s", file.c_str());
+    check_stat(st, file.c_str(), bad_modes, required_uid, required_gid);
     return st;
 }
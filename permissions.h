@@ -9,6 +9,7 @@
 namespace permissions {
 
     struct stat check(std::string file, int bad_modes, uid_t required_uid=-1, gid_t required_gid=-1);
+    struct stat check(int fd, std::string file, int bad_modes, uid_t required_uid=-1, gid_t required_gid=-1); // file is just for messages
 
 }
 #endif /* __PERMISSIONS_H__ */
@@ -3,6 +3,11 @@
 
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "posix-util.h"
 #include "strprintf.h"
 
@@ -37,3 +42,51 @@ void mkdir_pug(string base, string subdirs, mode_t mode, int uid, int gid)
         mkdir_pug(base, parent(subdirs), mode, uid, gid);
     mkdir_ug(base+subdirs, mode, uid, gid);
 }
+
+string find_in_path(string file, string path)
+{
+    size_t start = 0;
+    while (start <= path.length()) {
+        size_t sep = path.find(':', start);
+        if (sep == string::npos) sep = path.length();
+        string dir = path.substr(start, sep - start);
+        string candidate = dir + "/" + file;
+        struct stat st;
+        if (dir[0] == '/' && // Relative to what? We're not in the directory whoever's asking will be in.
+            stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_mode & 0111)
+            return candidate;
+        start = sep + 1;
+    }
+    return "";
+}
+
+int64_t monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t process_start_time(int pid)
+{
+#ifdef __linux__
+    char path[32], stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t red = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (red <= 0) return 0;
+    stat[red] = '\0';
+    // The name (field 2) is in parens and can have anything in it, including spaces and parens. starttime is field 22.
+    char *field = strrchr(stat, ')');
+    if (!field || field[1] != ' ' || field[2] == 'Z' || field[2] == 'X') // Dead and waiting to be (or being) reaped.
+        return 0;
+    for (int n = 2; n < 22 && field; n++)
+        field = strchr(field + 1, ' ');
+    return field ? strtoull(field + 1, NULL, 10) : 0;
+#else
+    (void)pid; // No /proc to look in.
+    return 0;
+#endif
+}
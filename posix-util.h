@@ -4,10 +4,16 @@
 #define __POSIX_UTIL_H__
 
 #include <string>
+#include <stdint.h>
 
 bool exists(std::string path);
 void mkdir_ug(std::string path, mode_t mode, int uid=-1, int gid=-1);
 void mkdir_pug(std::string base, std::string subdirs, mode_t mode, int uid=-1, int gid=-1);
+std::string find_in_path(std::string file, std::string path); // Like execvp() would. "" if it's not there.
+int64_t monotonic_ms(); // Milliseconds on a clock that doesn't jump around when someone sets the time.
+uint64_t process_start_time(int pid); // When pid started, in clock ticks since boot, so a reused pid can be told from the
+                                     // original. 0 if there's no such process, it's dead but not reaped yet, or we can't
+                                     // tell (anywhere but Linux).
 
 #endif /* __POSIX_UTIL_H__ */
 
@@ -0,0 +1,292 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "proc-stats.h"
+#include "daemon.h"
+#include "log.h"
+#include "timers.h"
+#include "foreach.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+#ifdef __linux__
+
+// Everything in /proc, so that each sample only has to look closely at what's new since the last one.
+struct proc {
+    int fd;       // Its /proc/<pid>/stat, kept open if it's a daemon's (and we have fds to spare). -1 otherwise.
+    int root;     // The pid of the daemon it belongs to, as of when it showed up. 0 if it's nobody's.
+    uint64_t cpu; // utime + stime at the last sample, in clock ticks.
+    unsigned long long start; // So a reused pid can't pass for it.
+    bool listed;  // Still in /proc this time around.
+};
+
+struct stat_fields {
+    char state;
+    int ppid, pgrp;
+    unsigned long utime, stime;
+    unsigned long long starttime;
+    long rss; // Pages.
+};
+
+static unordered_map<int, proc> procs;
+static DIR *proc_dir;
+static int64_t interval_ms, last_sample_us;
+static size_t fd_budget, fds_open;
+static long clock_ticks, page_size;
+static bool fd_count_from_stat; // Linux 6.2+ says how many fds a process has in the size of /proc/<pid>/fd.
+static bool warned_slow;
+
+static int64_t monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int open_stat(int pid)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static bool read_stat(int fd, stat_fields *f)
+{
+    char buf[1024];
+    ssize_t red = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (red <= 0) return false; // It's gone.
+    buf[red] = '\0';
+    // The name (field 2) is in parens and can have anything in it, so start after it with field 3.
+    const char *fields = strrchr(buf, ')');
+    return fields && sscanf(fields + 1, " %c %d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %llu %*u %ld",
+                            &f->state, &f->ppid, &f->pgrp, &f->utime, &f->stime, &f->starttime, &f->rss) == 7;
+}
+
+static bool read_stat(int pid, int fd, stat_fields *f)
+{
+    if (fd >= 0)
+        return read_stat(fd, f);
+    if ((fd = open_stat(pid)) < 0)
+        return false;
+    bool ok = read_stat(fd, f);
+    close(fd);
+    return ok;
+}
+
+static int count_fds(int pid)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    if (fd_count_from_stat) {
+        struct stat st;
+        return stat(path, &st) == 0 ? st.st_size : 0;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    int n = 0;
+    while (struct dirent *e = readdir(dir))
+        n += e->d_name[0] != '.';
+    closedir(dir);
+    return n;
+}
+
+static void close_proc(proc &p)
+{
+    if (p.fd < 0) return;
+    close(p.fd);
+    p.fd = -1;
+    fds_open--;
+}
+
+// Whose is it? A daemon's if it is one, or if the daemon leads its process group, or if its parent is the
+// daemon's. The parent might be new this time around too.
+static int find_root(int pid, const stat_fields &f, const unordered_map<int, stat_fields> &fresh, unordered_map<int, int> &roots, int depth = 0)
+{
+    if (daemon_by_pid(pid))    return pid;
+    if (daemon_by_pid(f.pgrp)) return f.pgrp;
+    auto known = procs.find(f.ppid);
+    if (known != procs.end())
+        return daemon_by_pid(known->second.root) ? known->second.root : 0;
+    auto found = roots.find(f.ppid);
+    if (found != roots.end())
+        return found->second;
+    auto parent = fresh.find(f.ppid);
+    if (parent == fresh.end() || depth > 64) // Its parent came and went between samples.
+        return 0;
+    return roots[f.ppid] = find_root(f.ppid, parent->second, fresh, roots, depth + 1);
+}
+
+struct tally {
+    uint64_t interval_ticks; // CPU used since the last sample.
+    uint64_t total_ticks;    // Same, plus everything used by processes we've never seen before.
+    uint64_t rss;
+    int fds, processes;
+};
+
+static void add_up(tally &t, int pid, const stat_fields &f, uint64_t ticks, bool in_interval)
+{
+    t.total_ticks += ticks;
+    if (in_interval)
+        t.interval_ticks += ticks;
+    if (f.state == 'Z') return; // Dead, just not reaped yet.
+    t.rss += f.rss;
+    t.fds += count_fds(pid);
+    t.processes++;
+}
+
+static void sample()
+{
+    int64_t start = monotonic_us();
+    unordered_map<int, tally> tallies;
+
+    // What's there now.
+    foreach(auto &p, procs)
+        p.second.listed = false;
+    vector<int> new_pids;
+    rewinddir(proc_dir);
+    while (struct dirent *e = readdir(proc_dir)) {
+        char *end;
+        int pid = strtol(e->d_name, &end, 10);
+        if (*end || pid <= 0) continue;
+        auto p = procs.find(pid);
+        if (p == procs.end())
+            new_pids.push_back(pid);
+        else
+            p->second.listed = true;
+    }
+
+    // The ones we already knew about.
+    size_t sampled = 0;
+    for (auto p = procs.begin(); p != procs.end(); ) {
+        proc &pr = p->second;
+        stat_fields f;
+        if (!pr.listed) {
+            close_proc(pr);
+            p = procs.erase(p);
+            continue;
+        }
+        if (pr.root && !daemon_by_pid(pr.root)) { // Left over from a run that's over. The next run doesn't get blamed for it.
+            close_proc(pr);
+            pr.root = 0;
+        }
+        if (!pr.root) {
+            p++;
+            continue;
+        }
+        if (!read_stat(p->first, pr.fd, &f)) {
+            close_proc(pr);
+            p = procs.erase(p);
+            continue;
+        }
+        if (f.starttime != pr.start) { // Without a stat file kept open, the pid can go to someone else between samples.
+            close_proc(pr);
+            new_pids.push_back(p->first);
+            p = procs.erase(p);
+            continue;
+        }
+        uint64_t cpu = f.utime + f.stime;
+        add_up(tallies[pr.root], p->first, f, cpu - pr.cpu, true);
+        pr.cpu = cpu;
+        sampled++;
+        p++;
+    }
+
+    // The new ones. Only the ones that turn out to be a daemon's keep their stat file open.
+    unordered_map<int, stat_fields> fresh;
+    unordered_map<int, int> fresh_fds;
+    foreach(int pid, new_pids) {
+        stat_fields f;
+        int fd = open_stat(pid);
+        if (fd < 0) continue;
+        if (read_stat(fd, &f)) {
+            fresh[pid] = f;
+            fresh_fds[pid] = fd;
+        } else
+            close(fd);
+    }
+    unordered_map<int, int> roots;
+    foreach(const auto &n, fresh) {
+        const stat_fields &f = n.second;
+        int fd = fresh_fds[n.first];
+        proc p = { -1, find_root(n.first, f, fresh, roots), f.utime + f.stime, f.starttime, true };
+        if (p.root && fds_open < fd_budget) {
+            p.fd = fd;
+            fds_open++;
+        } else
+            close(fd);
+        if (p.root) {
+            // A process that wasn't there last time did all its work since then--unless this is the first time.
+            add_up(tallies[p.root], n.first, f, p.cpu, last_sample_us != 0);
+            sampled++;
+        }
+        procs[n.first] = p;
+    }
+
+    double seconds = last_sample_us ? (start - last_sample_us) / 1e6 : 0;
+    foreach(const auto &t, tallies) {
+        class daemon *d = daemon_by_pid(t.first);
+        if (!d) continue;
+        proc_usage &u = d->usage;
+        u.cpu_percent = seconds > 0 ? t.second.interval_ticks * 100.0 / clock_ticks / seconds : 0;
+        u.cpu_ms     += t.second.total_ticks * 1000 / clock_ticks;
+        u.rss         = t.second.rss * page_size;
+        u.fds         = t.second.fds;
+        u.processes   = t.second.processes;
+        u.sampled     = true;
+    }
+
+    last_sample_us = start;
+    int64_t took_us = monotonic_us() - start;
+    log(LOG_DEBUG, "Sampled %zd processes for %zd daemons in %.2fms (%zd in /proc, %zd new, %zd stat files open)\n",
+        sampled, tallies.size(), took_us / 1000.0, procs.size(), new_pids.size(), fds_open);
+
+    // Keep it under 5% of our time, whatever it takes.
+    int64_t next = max(interval_ms, took_us / 1000 * 20);
+    if (next > interval_ms && !warned_slow) {
+        log(LOG_WARNING, "Sampling daemons' CPU and memory use took %.2fms, so it will happen less often than every %llds\n",
+            took_us / 1000.0, (long long)(interval_ms / 1000));
+        warned_slow = true;
+    }
+    timers.add_after(next, sample);
+}
+
+void start_proc_sampling(int64_t interval)
+{
+    if (interval <= 0) return;
+    proc_dir = opendir("/proc");
+    if (!proc_dir) {
+        log(LOG_WARNING, "Couldn't open /proc (so no CPU or memory use in status): %s\n", strerror(errno));
+        return;
+    }
+    interval_ms = interval;
+    clock_ticks = sysconf(_SC_CLK_TCK);
+    page_size   = sysconf(_SC_PAGESIZE);
+    struct rlimit rl;
+    fd_budget = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? rl.rlim_cur / 4 : 4096; // Leave plenty for everything else.
+    struct stat st;
+    fd_count_from_stat = stat("/proc/self/fd", &st) == 0 && st.st_size > 0;
+    timers.add_after(0, sample);
+}
+
+#else
+
+void start_proc_sampling(int64_t interval)
+{
+    if (interval > 0)
+        log(LOG_INFO, "Not sampling daemons' CPU and memory use (that needs Linux's /proc)\n");
+}
+
+#endif
@@ -0,0 +1,25 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __PROC_STATS_H__
+#define __PROC_STATS_H__
+
+#include <stdint.h>
+
+// What a daemon is using, totalled over its processes: the one we started, and everything that came from it
+// (the real daemon under a "sh -c", its workers, anything in a process group it leads). Filled in every so
+// often from /proc by the sampler below.
+struct proc_usage {
+    bool sampled;       // False until the first sample after a start (and always, anywhere but Linux).
+    double cpu_percent; // Over the last sample interval. Can be more than 100 with more than one CPU.
+    uint64_t cpu_ms;    // Since it started, not counting processes that came and went between samples.
+    uint64_t rss;       // Bytes.
+    int fds;
+    int processes;
+};
+
+// Samples every interval_ms (but backs off if sampling takes more than 5% of the time). Processes are
+// matched up to daemons when they first show up in /proc, and the ones that belong to a daemon stay open so
+// that each sample is just a pread() of their stat file. Logs and does nothing anywhere but Linux.
+void start_proc_sampling(int64_t interval_ms);
+
+#endif /* __PROC_STATS_H__ */
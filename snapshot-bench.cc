@@ -0,0 +1,61 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+// How long a re-exec spends writing out a snapshot and reading it back in, with a lot of daemons.
+// Build with "make snapshot-bench". Usage: ./snapshot-bench [daemons]
+
+#include "snapshot.h"
+#include "strprintf.h"
+#include "posix-util.h"
+#include "foreach.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+
+using namespace std;
+
+int main(int c, char **v)
+{
+    size_t daemons = c > 1 ? strtoul(v[1], NULL, 10) : 10000;
+    vector<map<string,string> > before;
+    for (size_t i = 0; i < daemons; i++) // Looks like daemon::to_map().
+        before.push_back({ {"id",                     strprintf("user%zd/daemon%zd", i % 100, i)},
+                           {"name",                   strprintf("daemon%zd", i)},
+                           {"config_file",            strprintf("/home/user%zd/.daemon-manager/daemons/daemon%zd.conf", i % 100, i)},
+                           {"user",                   strprintf("user%zd", i % 100)},
+                           {"current.pid",            strprintf("%zd", 10000 + i)},
+                           {"current.state",          "running"},
+                           {"current.cooldown",       "0"},
+                           {"current.cooldown_start", "0"},
+                           {"current.respawns",       strprintf("%zd", i % 7)},
+                           {"current.start_time",     "1700000000"},
+                           {"current.respawn_time",   "1700000000"},
+                           {"log.read_fd",            strprintf("%zd", 100 + 2*i)},
+                           {"log.write_fd",           strprintf("%zd", 101 + 2*i)},
+                           {"log.opened",             "1700000000"},
+                           {"log.bytes",              strprintf("%zd", i * 1000)} });
+
+    int fd = snapshot_fd();
+    int64_t start = monotonic_ms();
+    snapshot_writer w(fd, before.size());
+    foreach(const auto &m, before)
+        w.add(m);
+    w.finish();
+    int64_t wrote = monotonic_ms();
+
+    snapshot_reader r(fd);
+    size_t imported = 0, wrong = 0;
+    map<string,string> m;
+    while (r.next(m))
+        if (m != before[imported++]) wrong++;
+    int64_t red = monotonic_ms();
+
+    struct stat st;
+    fstat(fd, &st);
+    printf("%zd daemons, %lld bytes: wrote in %lldms, imported in %lldms, %zd lost, %zd wrong\n", daemons, (long long)st.st_size,
+           (long long)(wrote - start), (long long)(red - wrote), before.size() - imported, wrong);
+    return imported == before.size() && !wrong ? 0 : 1;
+}
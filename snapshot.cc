@@ -0,0 +1,147 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "snapshot.h"
+#include "strprintf.h"
+#include "foreach.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static const char magic[8] = "dm-snap";
+static const uint32_t version = 1;
+
+int snapshot_fd()
+{
+#ifdef __linux__
+    int fd = memfd_create("dm-snapshot", 0);
+    if (fd < 0) throw_strerr("memfd_create() failed");
+#else
+    char Template[] = "/tmp/daemon-manager-running-daemons.XXXXXXXXXXXX";
+    int fd = mkstemp(Template);
+    if (fd == -1) throw_strerr("mkstemp() failed [%s]", Template);
+    unlink(Template);
+#endif
+    return fd;
+}
+
+snapshot_writer::snapshot_writer(int fd, size_t count) : fd(fd)
+{
+    buffer.append(magic, sizeof(magic));
+    put_u32(version);
+    put_u32(count);
+}
+
+void snapshot_writer::put_u32(uint32_t n)
+{
+    buffer.append((char*)&n, sizeof(n));
+}
+
+void snapshot_writer::put_string(const string &s)
+{
+    put_u32(s.size());
+    buffer += s;
+}
+
+void snapshot_writer::add(const map<string,string> &fields)
+{
+    put_u32(fields.size());
+    foreach(const auto &f, fields) {
+        put_string(f.first);
+        put_string(f.second);
+    }
+    if (buffer.size() >= 64*1024)
+        flush();
+}
+
+void snapshot_writer::flush()
+{
+    for (size_t done = 0; done < buffer.size(); ) {
+        ssize_t wrote = write(fd, buffer.data() + done, buffer.size() - done);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) throw_strerr("Couldn't write the snapshot");
+        done += wrote;
+    }
+    buffer.clear();
+}
+
+void snapshot_writer::finish()
+{
+    flush();
+}
+
+bool snapshot_reader::is_snapshot(int fd)
+{
+    char header[sizeof(magic)];
+    return pread(fd, header, sizeof(header), 0) == sizeof(header) && memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+snapshot_reader::snapshot_reader(int fd) : fd(fd), offset(0), buffer_start(0), buffer_end(0), seen(0)
+{
+    struct stat st;
+    fstat(fd, &st) == 0 || throw_strerr("Couldn't stat the snapshot");
+    size = st.st_size;
+    char header[sizeof(magic)];
+    get(header, sizeof(header));
+    if (memcmp(header, magic, sizeof(magic)) != 0) throw_str("Not a snapshot");
+    uint32_t v = get_u32();
+    if (v != version) throw_str("Snapshot is version %u and not %u", v, version);
+    count = get_u32();
+}
+
+void snapshot_reader::get(void *out, size_t length)
+{
+    char *to = (char*)out;
+    while (length) {
+        if (buffer_start == buffer_end) {
+            ssize_t red = pread(fd, buffer, sizeof(buffer), offset);
+            if (red < 0 && errno == EINTR) continue;
+            if (red < 0) throw_strerr("Couldn't read the snapshot");
+            if (red == 0) throw_str("Snapshot is cut short (after %zd of %zd daemons)", seen, count);
+            offset += red;
+            buffer_start = 0;
+            buffer_end = red;
+        }
+        size_t n = min(length, buffer_end - buffer_start);
+        memcpy(to, buffer + buffer_start, n);
+        buffer_start += n;
+        to += n;
+        length -= n;
+    }
+}
+
+uint32_t snapshot_reader::get_u32()
+{
+    uint32_t n;
+    get(&n, sizeof(n));
+    return n;
+}
+
+string snapshot_reader::get_string()
+{
+    uint32_t length = get_u32();
+    off_t left = size - (offset - (off_t)(buffer_end - buffer_start));
+    if (length > left) throw_str("Snapshot is garbled (a %u byte string with %lld bytes left, in daemon %zd)", length, (long long)left, seen+1);
+    string s(length, '\0');
+    get(&s[0], length);
+    return s;
+}
+
+bool snapshot_reader::next(map<string,string> &fields)
+{
+    if (seen == count) return false;
+    fields.clear();
+    for (uint32_t n = get_u32(); n; n--) {
+        string key = get_string();
+        fields[key] = get_string();
+    }
+    seen++;
+    return true;
+}
+
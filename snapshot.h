@@ -0,0 +1,52 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <sys/types.h>
+
+// What we hand ourselves across a re-exec: every daemon's to_map(), one after the other. The format is a
+// header (magic, version, how many daemons) and then for each daemon a field count and length prefixed
+// keys and values. There's no escaping or parsing to speak of, and nothing has a maximum size.
+//
+// Written and read a daemon at a time, so nobody has to hold the whole thing.
+
+int snapshot_fd(); // A memfd on Linux, an unlinked temp file elsewhere. Not close-on-exec--it's for exec().
+
+class snapshot_writer {
+  public:
+    snapshot_writer(int fd, size_t count); // count: how many add()s there will be.
+    void add(const std::map<std::string,std::string> &fields);
+    void finish(); // Throws if any of it couldn't be written.
+
+  private:
+    int fd;
+    std::string buffer;
+    void put_u32(uint32_t n);
+    void put_string(const std::string &s);
+    void flush();
+};
+
+class snapshot_reader {
+  public:
+    static bool is_snapshot(int fd); // As opposed to the JSON older versions passed along.
+
+    explicit snapshot_reader(int fd); // Throws if it isn't one (or is a version we don't know).
+    size_t count;                     // How many records (daemons, then clients) the writer said there were.
+    bool next(std::map<std::string,std::string> &fields); // false at the end. Throws if it's cut short or garbled.
+
+  private:
+    int fd;
+    off_t offset, size;
+    char buffer[64*1024];
+    size_t buffer_start, buffer_end;
+    size_t seen;
+    void get(void *out, size_t length);
+    uint32_t get_u32();
+    std::string get_string();
+};
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,435 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "spawn.h"
+#include "strprintf.h"
+#include "foreach.h"
+#include "log.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <grp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  include <sys/prctl.h>
+#  include <sched.h>
+#endif
+
+using namespace std;
+
+exec_plan &exec_plan::operator=(const exec_plan &other)
+{
+    path   = other.path;
+    argv   = other.argv;
+    env    = other.env;
+    uid    = other.uid;
+    gid    = other.gid;
+    groups = other.groups;
+    dir    = other.dir;
+    seal(); // The pointers have to point at *our* strings.
+    return *this;
+}
+
+void exec_plan::seal()
+{
+    argv_p.clear();
+    foreach(const string &a, argv)
+        argv_p.push_back((char*)a.c_str());
+    argv_p.push_back(NULL);
+    env_p.clear();
+    foreach(const string &e, env)
+        env_p.push_back((char*)e.c_str());
+    env_p.push_back(NULL);
+}
+
+enum { step_stdout, step_close_fds, step_groups, step_gid, step_uid, step_dir, step_exec };
+
+string exec_plan::describe(const exec_failure &failure) const
+{
+    string what;
+    switch (failure.step) {
+        case step_stdout:    what = "Couldn't redirect stdout and stderr"; break;
+        case step_close_fds: what = "Couldn't close inherited file descriptors"; break;
+        case step_groups:    what = "Couldn't set supplementary groups"; break;
+        case step_gid:       what = strprintf("Couldn't set gid to %d", (int)gid); break;
+        case step_uid:       what = strprintf("Couldn't set uid to %d", (int)uid); break;
+        case step_dir:       what = strprintf("Couldn't change to directory %s", dir.c_str()); break;
+        case step_exec:      what = strprintf("Couldn't exec %s", path.c_str()); break;
+        default:             what = strprintf("Unknown failure %d", failure.step); break;
+    }
+    return what + ": " + strerror(failure.err);
+}
+
+// Close [first, last], but not past max_fd if we have to do it the slow way.
+static int close_fd_range(unsigned first, unsigned last, int max_fd)
+{
+    if (first > last) return 0;
+#if defined(__linux__) && defined(SYS_close_range)
+    if (syscall(SYS_close_range, first, last, 0) == 0) return 0;
+    if (errno != ENOSYS) return -1; // Older kernels don't have it.
+#endif
+    for (unsigned fd = first; fd <= last && fd < (unsigned)max_fd; fd++)
+        close(fd);
+    return 0;
+}
+
+// Runs in the vfork()ed child. Only async-signal-safe calls from here on in.
+void exec_plan::exec_child(int stdout_fd, int status_fd, int max_fd) const
+{
+    int step;
+    sigset_t none;
+    sigemptyset(&none);
+    struct sigaction dfl = {};
+    dfl.sa_handler = SIG_DFL;
+    sigemptyset(&dfl.sa_mask);
+
+    if (stdout_fd >= 0 &&
+        (dup2(stdout_fd, 1) < 0 || dup2(stdout_fd, 2) < 0))                  { step = step_stdout;    goto fail; }
+    // Everything except stdin, stdout, stderr and the status pipe (which is close-on-exec anyway).
+    if (close_fd_range(3, status_fd - 1, max_fd) < 0 ||
+        close_fd_range(status_fd + 1, ~0U, max_fd) < 0)                      { step = step_close_fds; goto fail; }
+    // The event loop blocks the signals it handles, and we (and the spawner) ignore some. Don't pass any of
+    // that on. Caught signals get reset by exec() anyway, so this doesn't hurt the parent's handlers.
+    for (int sig = 1; sig < NSIG; sig++)
+        if (sig != SIGKILL && sig != SIGSTOP)
+            sigaction(sig, &dfl, NULL);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (setgroups(groups.size(), groups.empty() ? NULL : &groups[0]) < 0) { step = step_groups;    goto fail; }
+    if (setgid(gid) < 0)                                                     { step = step_gid;       goto fail; }
+    if (setuid(uid) < 0)                                                     { step = step_uid;       goto fail; }
+    if (chdir(dir.c_str()) < 0)                                              { step = step_dir;       goto fail; }
+    execve(path.c_str(), &argv_p[0], &env_p[0]);
+    step = step_exec;
+
+  fail:
+    exec_failure failure = { step, errno };
+    write(status_fd, &failure, sizeof(failure));
+    _exit(127); // Like the shell does when it can't run something. And without running our atexit() handlers.
+}
+
+int exec_plan::spawn(int stdout_fd, int *exec_status_fd, bool as_sibling) const
+{
+    if (argv_p.size() != argv.size() + 1 || env_p.size() != env.size() + 1)
+        throw_str("exec plan for %s wasn't sealed", path.c_str());
+
+    int fd[2];
+#ifdef __linux__
+    pipe2(fd, O_CLOEXEC) == 0 || throw_strerr("Couldn't pipe");
+#else
+    pipe(fd) == 0 || throw_strerr("Couldn't pipe");
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+    int max_fd = sysconf(_SC_OPEN_MAX);
+
+    int child;
+#ifndef __linux__
+    (void)as_sibling; // Nothing like CLONE_PARENT here. start_spawner() won't have started one anyway.
+#else
+    if (as_sibling)
+        // Really fork(), just with a different parent. The spawner is small so there's nothing to be gained
+        // from vfork(), and this way it doesn't have to sit around waiting for the exec.
+        child = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    else
+#endif
+        child = vfork();
+    if (child == 0)
+        exec_child(stdout_fd, fd[1], max_fd);
+
+    // With vfork() we only get here once the child has exec()ed or given up.
+    int vfork_errno = errno;
+    close(fd[1]);
+    if (child < 0) {
+        close(fd[0]);
+        errno = vfork_errno;
+        throw_strerr("vfork() failed");
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    *exec_status_fd = fd[0];
+    return child;
+}
+
+// Just a bunch of NUL terminated strings, in a fixed order. Numbers are in decimal.
+static void put(string &s, const string &value)
+{
+    s += value;
+    s += '\0';
+}
+
+string exec_plan::serialize() const
+{
+    string s;
+    put(s, path);
+    put(s, dir);
+    put(s, strprintf("%u", (unsigned)uid));
+    put(s, strprintf("%u", (unsigned)gid));
+    put(s, strprintf("%zu", groups.size()));
+    foreach(gid_t g, groups)
+        put(s, strprintf("%u", (unsigned)g));
+    put(s, strprintf("%zu", argv.size()));
+    foreach(const string &a, argv)
+        put(s, a);
+    put(s, strprintf("%zu", env.size()));
+    foreach(const string &e, env)
+        put(s, e);
+    return s;
+}
+
+struct unserializer {
+    const char *p, *end;
+    string str() {
+        const char *nul = (const char *)memchr(p, '\0', end - p);
+        if (!nul) throw_str("Truncated exec plan");
+        string s(p, nul);
+        p = nul + 1;
+        return s;
+    }
+    unsigned long num() {
+        string s = str();
+        char *e;
+        unsigned long n = strtoul(s.c_str(), &e, 10);
+        if (s.empty() || *e) throw_str("Bad number \"%s\" in exec plan", s.c_str());
+        return n;
+    }
+    template<class T> void list(vector<T> &l, T (unserializer::*get)()) {
+        unsigned long count = num();
+        if (count > (unsigned long)(end - p)) throw_str("Bad count in exec plan"); // Each one takes at least a byte.
+        l.clear();
+        for (unsigned long i = 0; i < count; i++)
+            l.push_back((this->*get)());
+    }
+    gid_t group() { return num(); }
+};
+
+exec_plan exec_plan::unserialize(const char *data, size_t length)
+{
+    unserializer u = { data, data + length };
+    exec_plan plan;
+    plan.path = u.str();
+    plan.dir  = u.str();
+    plan.uid  = u.num();
+    plan.gid  = u.num();
+    u.list(plan.groups, &unserializer::group);
+    u.list(plan.argv, &unserializer::str);
+    u.list(plan.env, &unserializer::str);
+    plan.seal();
+    return plan;
+}
+
+#ifdef __linux__
+
+static const size_t spawn_request_max = 256*1024;
+
+struct spawn_reply {
+    int pid; // 0 on failure
+    char error[256];
+};
+
+static int spawner_sock = -1, spawner_pid;
+
+// *fd gets the descriptor that came with the message, or -1 if there wasn't one.
+static ssize_t recv_with_fd(int sock, void *buf, size_t len, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got;
+    while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    *fd = -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); got >= 0 && c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(c), sizeof(int));
+    if (got >= 0 && msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        if (*fd >= 0) close(*fd);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return got;
+}
+
+static ssize_t send_with_fd(int sock, const void *buf, size_t len, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct iovec iov = { (void*)buf, len };
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return sent;
+}
+
+static void spawner_main(int sock)
+{
+    prctl(PR_SET_NAME, "dm-spawner");
+    // We quit when the manager closes its end. Until then, leave the signals to it.
+    signal(SIGINT,  SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGHUP,  SIG_IGN);
+    int max_fd = sysconf(_SC_OPEN_MAX);
+    close_fd_range(3, sock - 1, max_fd);
+    close_fd_range(sock + 1, ~0U, max_fd);
+
+    static char request[spawn_request_max];
+    while (1) {
+        int log_fd;
+        ssize_t got = recv_with_fd(sock, request, sizeof(request), &log_fd);
+        if (got == 0 || got < 0 && errno != EMSGSIZE)
+            _exit(0);
+
+        spawn_reply reply = {};
+        int exec_status_fd = -1;
+        try {
+            if (got < 0) throw_strerr("Couldn't receive spawn request");
+            reply.pid = exec_plan::unserialize(request, got).spawn(log_fd, &exec_status_fd, true);
+        } catch (std::exception &e) {
+            snprintf(reply.error, sizeof(reply.error), "%s", e.what());
+        }
+        send_with_fd(sock, &reply, sizeof(reply), exec_status_fd);
+        if (exec_status_fd >= 0) close(exec_status_fd);
+        if (log_fd >= 0) close(log_fd);
+    }
+}
+
+// A request goes over as one datagram, and the biggest ones don't fit in the default socket buffer.
+static void make_room_for_requests(int sock)
+{
+    int size = spawn_request_max + 4096; // Plus the kernel's bookkeeping.
+    // The FORCE versions get past net.core.wmem_max/rmem_max, but only for root.
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+bool start_spawner()
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        log(LOG_ERR, "Couldn't make a socket for the spawner: %s\n", strerror(errno));
+        return false;
+    }
+    make_room_for_requests(sv[0]);
+    make_room_for_requests(sv[1]);
+    int pid = fork();
+    if (pid < 0) {
+        log(LOG_ERR, "Couldn't fork the spawner: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0)
+        spawner_main(sv[1]);
+
+    close(sv[1]);
+    spawner_sock = sv[0];
+    spawner_pid = pid;
+    fcntl(spawner_sock, F_SETFL, O_NONBLOCK); // Its end blocks. Ours never waits on it.
+    log(LOG_INFO, "Started spawner (pid %d)\n", pid);
+    return true;
+}
+
+int spawner_fd()
+{
+    return spawner_sock;
+}
+
+void stop_spawner()
+{
+    if (spawner_sock < 0) return;
+    close(spawner_sock); // It'll see EOF and quit, if it's still alive,
+    kill(spawner_pid, SIGKILL); // or this will, if it's wedged. It's our child, so it gets reaped like one.
+    spawner_sock = -1;
+    spawner_pid = 0;
+}
+
+int ask_spawner(const exec_plan &plan, int stdout_fd)
+{
+    if (spawner_sock < 0) return -1;
+    string request = plan.serialize();
+    if (request.size() > spawn_request_max)
+        throw_str("Too much to send to the spawner (%zd bytes of arguments and environment)", request.size());
+    if (send_with_fd(spawner_sock, request.data(), request.size(), stdout_fd) < 0) {
+        if (errno == EAGAIN || errno == ENOBUFS)
+            return 0; // It's behind. This one can go around it.
+        if (errno == EMSGSIZE)
+            return 0; // Bigger than the socket will take, so this one goes around it too. The spawner's fine.
+        log(LOG_ERR, "Couldn't send to the spawner: %s\n", strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+int hear_from_spawner(spawner_answer *answer)
+{
+    if (spawner_sock < 0) return -1;
+    spawn_reply reply;
+    int exec_status_fd;
+    ssize_t got = recv_with_fd(spawner_sock, &reply, sizeof(reply), &exec_status_fd);
+    if (got < 0 && errno == EAGAIN)
+        return 0;
+    if (got == sizeof(reply) && reply.pid && exec_status_fd >= 0) {
+        fcntl(exec_status_fd, F_SETFL, O_NONBLOCK);
+        *answer = (spawner_answer) { reply.pid, "", exec_status_fd };
+        return 1;
+    }
+    if (got == sizeof(reply) && !reply.pid && exec_status_fd < 0) {
+        reply.error[sizeof(reply.error)-1] = '\0';
+        *answer = (spawner_answer) { 0, reply.error, -1 };
+        return 1;
+    }
+    if (exec_status_fd >= 0) close(exec_status_fd);
+    log(LOG_ERR, "Couldn't hear back from the spawner: %s\n",
+        got < 0 ? strerror(errno) : got == 0 ? "it hung up" : "it made no sense");
+    return -1;
+}
+
+#else /* !__linux__ */
+
+bool start_spawner()
+{
+    log(LOG_WARNING, "The spawner is only supported on Linux. Launching daemons ourselves.\n");
+    return false;
+}
+
+int spawner_fd()
+{
+    return -1;
+}
+
+void stop_spawner()
+{
+}
+
+int ask_spawner(const exec_plan &plan, int stdout_fd)
+{
+    (void)plan; (void)stdout_fd; // There's never a spawner to ask.
+    return -1;
+}
+
+int hear_from_spawner(spawner_answer *answer)
+{
+    (void)answer; // Nor anything to hear.
+    return -1;
+}
+
+#endif
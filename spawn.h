@@ -0,0 +1,76 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __SPAWN_H__
+#define __SPAWN_H__
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Everything needed to launch a process, worked out ahead of time so that launching is just vfork() and a
+// handful of system calls. The child shares our memory and we're frozen until it execs, so it can't
+// allocate, take locks, throw or touch anything that isn't already sitting here ready to go. That also means
+// it doesn't matter how big we've gotten--there's no copying the address space like fork() does.
+class exec_plan {
+  public:
+    std::string path;       // What gets exec()ed. argv[0] is separate.
+    std::vector<std::string> argv;
+    std::vector<std::string> env; // "NAME=value"
+    uid_t uid;
+    gid_t gid;
+    std::vector<gid_t> groups;    // Supplementary groups.
+    std::string dir;
+
+    exec_plan() : uid(0), gid(0) {}
+    exec_plan(const exec_plan &other) { *this = other; }
+    exec_plan &operator=(const exec_plan &other);
+
+    void seal(); // Call after changing argv or env.
+
+    // Returns the pid. stdout_fd, if >= 0, becomes the child's stdout and stderr. Every other fd except
+    // stdin gets closed. *exec_status_fd is the (non-blocking) read end of a pipe that closes without a
+    // word if the exec worked. If it didn't, read an exec_failure out of it and describe() it.
+    // as_sibling makes the process our parent's child instead of ours (Linux only). That's for the spawner.
+    int spawn(int stdout_fd, int *exec_status_fd, bool as_sibling = false) const;
+
+    std::string serialize() const;
+    static exec_plan unserialize(const char *data, size_t length);
+
+    struct exec_failure {
+        int step;
+        int err;
+    };
+    std::string describe(const exec_failure &failure) const;
+
+  private:
+    std::vector<char*> argv_p, env_p; // NULL terminated pointers into argv and env, for execve().
+    void exec_child(int stdout_fd, int status_fd, int max_fd) const __attribute__ ((noreturn));
+};
+
+// The spawner is a little helper process, forked before we've loaded anything, that does the launching for
+// us so it costs the same no matter how big we get. It launches the daemons as siblings of itself, so
+// they're still our children and we wait() for them like always. Linux only.
+bool start_spawner(); // Logs and returns false if it can't.
+
+// Nothing here waits for the spawner. ask_spawner() sends a request off, and the answers come back in the
+// same order, through hear_from_spawner(), once spawner_fd() is readable. Keeping track of whose answer is
+// whose (and giving up on a spawner that's stopped answering) is up to the caller.
+int spawner_fd(); // Non-blocking. -1 if there's no spawner (any more).
+
+// 1 if it's on its way, 0 if the spawner can't take it right now (launch this one with plan.spawn()), or -1
+// if the spawner's stopped working. Throws if the plan is too big to ever send.
+int ask_spawner(const exec_plan &plan, int stdout_fd);
+
+struct spawner_answer {
+    int pid;            // 0 if it couldn't launch it,
+    std::string error;  // and this says why.
+    int exec_status_fd; // Like exec_plan::spawn()'s.
+};
+// 1 if there was an answer, 0 if there isn't one yet, or -1 if the spawner's stopped working.
+int hear_from_spawner(spawner_answer *answer);
+
+// Once it's stopped working (or stopped answering). Closes our end, so stop watching spawner_fd() first.
+// Any questions it hadn't answered yet never will be.
+void stop_spawner();
+
+#endif /* __SPAWN_H__ */
@@ -0,0 +1,188 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "state-journal.h"
+#include "strprintf.h"
+#include "foreach.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static const char magic[8] = "dm-jrn1"; // The number is the version of the record format.
+static const size_t initial_size = 1024*1024;
+
+struct header {
+    char magic[8];
+    char boot_id[40];
+};
+
+struct record {
+    uint32_t length;    // Of the whole record, padded out to 8 bytes. Stored last (see append()), so 0 is the end.
+    int32_t pid;
+    int32_t state;
+    uint32_t id_length; // The id comes right after.
+    uint64_t pid_start;
+    int64_t start_time;
+};
+
+static size_t record_size(size_t id_length)
+{
+    return (sizeof(record) + id_length + 7) & ~(size_t)7;
+}
+
+// Different every boot, so a journal that survived a reboot (because someone put it somewhere that isn't
+// cleared) doesn't get taken seriously.
+static string boot_id()
+{
+    string id;
+#ifdef __linux__
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char buf[sizeof(((header*)0)->boot_id)];
+        ssize_t red = read(fd, buf, sizeof(buf) - 1);
+        if (red > 0)
+            id.assign(buf, red);
+        close(fd);
+    }
+#endif
+    return id;
+}
+
+state_journal::state_journal(string path) : path(path), fd(-1), base(NULL), size(0), used(0)
+{
+}
+
+state_journal::~state_journal()
+{
+    close();
+}
+
+void state_journal::close()
+{
+    if (base)
+        munmap(base, size);
+    if (fd >= 0)
+        ::close(fd);
+    base = NULL;
+    fd = -1;
+}
+
+map<string,state_journal::entry> state_journal::recover()
+{
+    map<string,entry> found;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) return found;
+    if (fd < 0) throw_strerr("Couldn't open %s", path.c_str());
+    struct stat st;
+    void *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(header))
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) return found;
+
+    const char *data = (const char*)m;
+    const header *h = (const header*)data;
+    string boot = boot_id();
+    if (memcmp(h->magic, magic, sizeof(magic)) == 0 && strncmp(h->boot_id, boot.c_str(), sizeof(h->boot_id)) == 0)
+        for (size_t off = sizeof(header); off + sizeof(record) <= (size_t)st.st_size; ) {
+            const record *r = (const record*)(data + off);
+            if (r->length == 0 || r->length != record_size(r->id_length) || off + r->length > (size_t)st.st_size)
+                break; // The end, or whatever we were in the middle of writing when we died.
+            string id(data + off + sizeof(record), r->id_length);
+            if (r->pid)
+                found[id] = (entry) { r->state, r->pid, r->pid_start, (time_t)r->start_time };
+            else
+                found.erase(id);
+            off += r->length;
+        }
+    munmap(m, st.st_size);
+    return found;
+}
+
+void state_journal::open()
+{
+    rewrite();
+}
+
+void state_journal::note(const string &id, const entry &e)
+{
+    if (e.pid)
+        running[id] = e;
+    else
+        running.erase(id);
+    if (fd < 0) return;
+    try {
+        if (used + record_size(id.size()) > size)
+            rewrite(); // Which includes this one.
+        else
+            append(id, e);
+    } catch (...) {
+        close(); // Better no journal than one that's wrong.
+        throw;
+    }
+}
+
+// Written off to the side and renamed into place, so there's always a whole journal there to recover from.
+void state_journal::rewrite()
+{
+    size_t need = sizeof(header);
+    foreach(const auto &r, running)
+        need += record_size(r.first.size());
+    size_t new_size = initial_size;
+    while (new_size < need * 2) // Room to grow before the next rewrite.
+        new_size *= 2;
+
+    string tmp = path + ".new";
+    int new_fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (new_fd < 0) throw_strerr("Couldn't create %s", tmp.c_str());
+    void *m = MAP_FAILED;
+    if (ftruncate(new_fd, new_size) == 0)
+        m = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, new_fd, 0);
+    if (m == MAP_FAILED) {
+        int saved_errno = errno;
+        ::close(new_fd);
+        unlink(tmp.c_str());
+        errno = saved_errno;
+        throw_strerr("Couldn't map %s (%zd bytes)", tmp.c_str(), new_size);
+    }
+
+    close();
+    fd = new_fd;
+    base = (char*)m;
+    size = new_size;
+    header *h = (header*)base;
+    memcpy(h->magic, magic, sizeof(magic));
+    strncpy(h->boot_id, boot_id().c_str(), sizeof(h->boot_id) - 1);
+    used = sizeof(header);
+    foreach(const auto &r, running)
+        append(r.first, r.second);
+
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        int saved_errno = errno;
+        close();
+        unlink(tmp.c_str());
+        errno = saved_errno;
+        throw_strerr("Couldn't rename %s to %s", tmp.c_str(), path.c_str());
+    }
+}
+
+void state_journal::append(const string &id, const entry &e)
+{
+    record *r = (record*)(base + used);
+    uint32_t length = record_size(id.size());
+    r->pid        = e.pid;
+    r->state      = e.state;
+    r->id_length  = id.size();
+    r->pid_start  = e.pid_start;
+    r->start_time = e.start_time;
+    memcpy(r + 1, id.data(), id.size());
+    // Everything else has to be there before the length says it is. The file was zero filled by
+    // ftruncate(), so until now this was the end.
+    __atomic_store_n(&r->length, length, __ATOMIC_RELEASE);
+    used += length;
+}
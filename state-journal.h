@@ -0,0 +1,53 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __STATE_JOURNAL_H__
+#define __STATE_JOURNAL_H__
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <stdint.h>
+#include <time.h>
+
+// Which daemons have a process running, written down as it happens so that if we crash (or get SIGKILLed)
+// the next one of us can adopt them instead of starting a second copy of everything. A re-exec doesn't need
+// it--the snapshot has all this and more.
+//
+// The file is mmap()ed and only ever appended to: a header (with the boot id, since pids mean nothing after
+// a reboot) followed by a record for each change. A record's length is stored last, so one that was half
+// written when we died reads as the end. Nothing needs an msync()--the kernel has the pages the moment
+// they're written, and if the whole machine goes down there's nothing left to adopt anyway. When it fills
+// up, it gets rewritten with just what's still running (and made bigger if that's most of it).
+class state_journal {
+  public:
+    struct entry {
+        int state;         // A run_state.
+        int pid;           // 0 means nothing running.
+        uint64_t pid_start; // See process_start_time().
+        time_t start_time;
+    };
+
+    explicit state_journal(std::string path);
+    ~state_journal();
+
+    // What the last one of us left running, by daemon id. Empty if there's no journal, or it's from before
+    // a reboot. Doesn't check that any of them are still running.
+    std::map<std::string,entry> recover();
+
+    // Starts a new journal with what's running now (notes from before this are included). Throws if it can't.
+    void open();
+    void note(const std::string &id, const entry &e); // Closes the journal (and throws) if it can't write.
+    void close();
+
+    std::string path;
+
+  private:
+    int fd;
+    char *base;
+    size_t size, used;
+    std::unordered_map<std::string,entry> running; // What a rewrite writes.
+    void rewrite();
+    void append(const std::string &id, const entry &e);
+};
+
+#endif /* __STATE_JOURNAL_H__ */
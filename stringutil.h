@@ -37,6 +37,34 @@ void split(Container &list, std::string s, std::string separator)
     }
 }
 
+// Splits on whitespace, except inside '' or "" quotes. A backslash escapes the next character, except inside
+// '' quotes. No other shell stuff ($variables, globs, etc.). Returns false if a quote isn't closed.
+template<typename Container>
+bool split_words(Container &list, std::string s)
+{
+    std::string word;
+    bool in_word = false;
+    char quote = 0;
+    for (size_t i = 0; i < s.length(); i++) {
+        char c = s[i];
+        if (quote == '\'' && c != '\'' ||
+            quote == '"' && c != '"' && c != '\\')   { word += c; continue; }
+        if (c == '\\' && i+1 < s.length())        { word += s[++i]; in_word = true; continue; }
+        if (c == quote)                               { quote = 0; continue; }
+        if (!quote && (c == '\'' || c == '"'))       { quote = c; in_word = true; continue; }
+        if (isspace(c)) {
+            if (in_word) list.push_back(word);
+            word.clear();
+            in_word = false;
+            continue;
+        }
+        word += c;
+        in_word = true;
+    }
+    if (in_word) list.push_back(word);
+    return !quote;
+}
+
 template<typename Container>
 std::string join(Container list, std::string separator)
 {
@@ -0,0 +1,48 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org>
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+
+#include "timers.h"
+#include "posix-util.h"
+
+using namespace std;
+
+timer_queue timers;
+
+timer_queue::timer_id timer_queue::add(int64_t when_ms, callback cb)
+{
+    timer_id id = ++last_id;
+    by_id[id] = queue.insert(make_pair(when_ms, make_pair(id, cb)));
+    return id;
+}
+
+timer_queue::timer_id timer_queue::add_after(int64_t delay_ms, callback cb)
+{
+    return add(monotonic_ms() + delay_ms, cb);
+}
+
+void timer_queue::cancel(timer_id &id)
+{
+    auto t = by_id.find(id);
+    if (t != by_id.end()) {
+        queue.erase(t->second);
+        by_id.erase(t);
+    }
+    id = 0;
+}
+
+int64_t timer_queue::next_deadline()
+{
+    return queue.empty() ? -1 : queue.begin()->first;
+}
+
+void timer_queue::run_expired()
+{
+    int64_t now = monotonic_ms();
+    // One at a time, since callbacks are allowed to add and cancel timers (even their own).
+    while (!queue.empty() && queue.begin()->first <= now) {
+        callback cb = queue.begin()->second.second;
+        by_id.erase(queue.begin()->second.first);
+        queue.erase(queue.begin());
+        cb();
+    }
+}
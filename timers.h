@@ -0,0 +1,36 @@
+//  Copyright (c) 2026 David Caldwell <david@porkrind.org> -*- c++ -*-
+//  Licenced under the GPL 3.0 or any later version. See LICENSE file for details.
+#ifndef __TIMERS_H__
+#define __TIMERS_H__
+
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <stdint.h>
+
+// Things that need to happen later. Times are on the monotonic_ms() clock so setting the system time can't
+// make them fire early or late. Adding and cancelling are O(log n) and finding the next deadline is O(1), so
+// nothing ever has to walk all the daemons to figure out what's due.
+class timer_queue {
+  public:
+    typedef uint64_t timer_id; // 0 is never a valid id, so it can be used for "no timer".
+    typedef std::function<void()> callback;
+
+    timer_queue() : last_id(0) {}
+    timer_id add(int64_t when_ms, callback cb);
+    timer_id add_after(int64_t delay_ms, callback cb);
+    void cancel(timer_id &id); // Sets id to 0. Cancelling 0 (or something that already fired) is fine.
+    int64_t next_deadline();   // -1 if nothing is scheduled.
+    void run_expired();
+
+  private:
+    typedef std::multimap<int64_t, std::pair<timer_id, callback> > schedule;
+    schedule queue;
+    std::unordered_map<timer_id, schedule::iterator> by_id;
+    timer_id last_id;
+};
+
+extern timer_queue timers;
+
+#endif /* __TIMERS_H__ */
+
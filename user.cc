@@ -7,7 +7,11 @@
 #include "posix-util.h"
 #include "passwd.h"
 #include <string>
-#include <glob.h>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 using namespace std;
 
@@ -30,6 +34,9 @@ void user::init(const pwent &pw, string daemondir, string logdir)
     if (logdir.size()    && logdir.back()    == '/') logdir.pop_back();
     this->daemondir = daemondir;
     this->logdir = logdir;
+    config_dir_path = replace_dir_patterns(daemondir);
+    log_dir_path    = replace_dir_patterns(logdir);
+    config_watched = false;
 }
 
 string user::replace_dir_patterns(string pattern)
@@ -51,32 +58,42 @@ void user::create_dirs()
         mkdir_pug(homedir, logdir.substr(2,logdir.length()), 0750, uid, gid);
 }
 
-string user::config_path()
+bool is_config_name(const char *name)
 {
-    return replace_dir_patterns(daemondir);
+    size_t len = strlen(name);
+    return name[0] != '.' && len > 5 && strcmp(name + len - 5, ".conf") == 0; // What "*.conf" would glob.
 }
 
-string user::log_dir()
+// Returns the names (not paths) of the *.conf files in config_path(), sorted. The directory is opened once and
+// left open in *dir_fd (the caller closes it) so the files can be fstatat()ed and openat()ed relative to it
+// instead of resolving the whole path over and over.
+vector<string> user::config_files(int *dir_fd)
 {
-    return replace_dir_patterns(logdir);
-}
-
-vector<string> user::config_files()
-{
-    permissions::check(config_path(), 0002, uid);
-    // check permissions
-
+    int fd = open(config_dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) throw_str("%s doesn't exist", config_dir_path.c_str());
+    DIR *dir = NULL;
     vector<string> files;
-    glob_t gl;
-    int status = glob((config_path() + "/*.conf").c_str(), 0, NULL, &gl);
-
-    for (size_t i=0; i<gl.gl_pathc; i++)
-        files.push_back(string(gl.gl_pathv[i]));
-
-    globfree(&gl);
-    if (status != GLOB_NOMATCH && status != 0)
-        throw_strerr("Glob failed: %d", status);
-
+    try {
+        permissions::check(fd, config_dir_path, 0002, uid);
+        // fdopendir() takes over the fd it's given, so give it its own.
+        int list_fd = dup(fd);
+        if (list_fd < 0 || !(dir = fdopendir(list_fd))) {
+            if (list_fd >= 0) close(list_fd);
+            throw_strerr("Couldn't read directory %s", config_dir_path.c_str());
+        }
+        errno = 0;
+        for (struct dirent *ent; (ent = readdir(dir)); errno = 0)
+            if (is_config_name(ent->d_name))
+                files.push_back(ent->d_name);
+        if (errno) throw_strerr("Couldn't read directory %s", config_dir_path.c_str());
+    } catch (...) {
+        if (dir) closedir(dir);
+        close(fd);
+        throw;
+    }
+    closedir(dir);
+    sort(files.begin(), files.end());
+    *dir_fd = fd;
     return files;
 }
 
@@ -21,16 +21,22 @@ class user {
     string daemondir;
     map<uid_t,bool> can_run_as_uid;
     vector<user*> manages;
+    map<user*,bool> can_manage;       // Same as manages, but quick to look things up in.
+    vector<class daemon*> daemons;    // The daemons whose config files live in our config_path().
+    bool config_watched;   // config_path() is being watched for changes (see config-watch.h)
 
     user(string name, string daemondir, string logdir);
     void create_dirs();
-    string config_path();
-    string log_dir();
-    vector<string> config_files();
+    string config_path() { return config_dir_path; }
+    string log_dir()     { return log_dir_path; }
+    vector<string> config_files(int *dir_fd);
   private:
+    string config_dir_path, log_dir_path; // daemondir and logdir, after replace_dir_patterns().
     void init(const pwent &pw, string daemondir, string logdir);
     string replace_dir_patterns(string pattern);
 };
 
+bool is_config_name(const char *name);
+
 #endif /* __USER_H__ */
 